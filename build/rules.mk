@@ -53,7 +53,7 @@ ifeq ($(filter 1,$(SAN) $(UBSAN)),1)
 KERNEL_OBJS += $(OBJDIR)/k-sanitizers.ko
 KERNELCXXFLAGS += -DHAVE_SANITIZERS
 SANITIZEFLAGS := -fsanitize=undefined -fsanitize=kernel-address
-$(OBJDIR)/k-alloc.ko $(OBJDIR)/k-sanitizers.ko: SANITIZEFLAGS :=
+$(OBJDIR)/k-alloc.ko $(OBJDIR)/k-slab.ko $(OBJDIR)/k-sanitizers.ko: SANITIZEFLAGS :=
 endif
 
 # GFX toggle
@@ -62,6 +62,11 @@ KERNELCXXFLAGS += -DGFX
 BOOTENTRYFLAGS += -DGFX
 endif
 
+# KALLOC_TRACK toggle: record the call site of every kalloc
+ifeq ($(filter 1,$(KALLOC_TRACK)),1)
+KERNELCXXFLAGS += -DKALLOC_TRACK=1
+endif
+
 # Linker flags
 LDFLAGS := $(LDFLAGS) -Os --gc-sections -z max-page-size=0x1000 -static -nostdlib -nostartfiles
 LDFLAGS	+= $(shell $(LD) -m elf_x86_64 --help >/dev/null 2>&1 && echo -m elf_x86_64)
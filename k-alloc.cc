@@ -1,11 +1,11 @@
 #include "kernel.hh"
 #include "k-list.hh"
 #include "k-lock.hh"
+#include "k-vmiter.hh"
 
 static spinlock page_lock;
 
 // allocator constants
-#define NPAGES (MEMSIZE_PHYSICAL / PAGESIZE)
 #define MIN_ORDER 12
 #define MAX_ORDER 24
 #define NORDERS (MAX_ORDER - MIN_ORDER + 1)
@@ -16,12 +16,71 @@ struct pagestate {
     int order;
     int pindex;
     bool allocated;
+    bool cached;            // parked in a per-CPU magazine
+    bool dirty;             // contents not known to be zero
+    bool isolated;          // held by `compact`
+    int extra_refs;         // references beyond the first (`kalloc_ref`)
 };
-static pagestate pages[NPAGES];
+// `pages` covers [0, memsize_physical) and is placed in physical memory
+// by `init_kalloc`, so its size tracks the installed memory
+static pagestate* pages;
+static size_t npages;
 
 // memory block linked lists
+//    Dirty blocks sit at the front of each list and clean (zeroed) blocks
+//    at the back, so `kalloc` can use dirty memory first and
+//    `kalloc_zeroed` can find clean memory without a search.
 static list<pagestate, &pagestate::link_> _free_block_lists[NORDERS];
 
+// number of pages in free blocks, and in clean free blocks
+static size_t nfree_pages;
+static size_t nfree_clean_pages;
+
+// bit `order - MIN_ORDER` is set iff the free list for `order` is nonempty
+static unsigned nonempty_orders;
+
+// free-block bitmaps
+//    For each order there is one bit per aligned block of that order; it
+//    is set iff that block is on the free list for that order. `kfree`
+//    checks buddies here instead of loading their `pagestate`s. They are
+//    allocated together with `pages`.
+#define FREEMAP_WORDS(order) \
+    (((npages >> ((order) - MIN_ORDER)) + 63) / 64)
+static uint64_t* freemaps[NORDERS];
+
+// one bit per page, set by `compact` for pages mapped by user page tables
+static uint64_t* movemap;
+
+#if KALLOC_TRACK
+// allocation tracking
+//    With `make KALLOC_TRACK=1`, every allocated block records its
+//    allocating call site and process in `tags`, indexed by the block's
+//    first pindex. `kfree` clears the tag and reports bad frees, and
+//    `kalloc_dump` prints live memory by call site and by process.
+struct alloctag {
+    uintptr_t site;             // return address of the `kalloc` call
+    pid_t pid;                  // allocating process, or -1 for kernel
+};
+static alloctag* tags;          // allocated together with `pages`
+#endif
+
+// freemap_test(order, pindex), freemap_flip(order, pindex)
+//    Test or flip the free bit for the block of `order` at `pindex`.
+static bool freemap_test(int order, int pindex) {
+    unsigned bit = pindex >> (order - MIN_ORDER);
+    return freemaps[order - MIN_ORDER][bit / 64] & (1UL << (bit % 64));
+}
+
+static void freemap_flip(int order, int pindex) {
+    unsigned bit = pindex >> (order - MIN_ORDER);
+    freemaps[order - MIN_ORDER][bit / 64] ^= 1UL << (bit % 64);
+}
+
+// the idle task pre-zeroes free blocks until this many pages are clean
+#define PREZERO_TARGET (npages / 4)
+// largest block the idle task zeroes at once
+#define PREZERO_MAX_ORDER 16
+
 
 // free_blocks(order)
 //    Returns a pointer to the linked list containing free blocks of size order
@@ -32,6 +91,37 @@ static list<pagestate, &pagestate::link_>* free_blocks(int order) {
 }
 
 
+// freelist_push(b), freelist_erase(b)
+//    Add or remove free block `b` from its free list, keeping dirty blocks
+//    in front of clean ones. Require `page_lock`.
+static void freelist_push(pagestate* b) {
+    assert(!freemap_test(b->order, b->pindex));
+    freemap_flip(b->order, b->pindex);
+    nonempty_orders |= 1U << (b->order - MIN_ORDER);
+    nfree_pages += 1UL << (b->order - MIN_ORDER);
+    if (b->dirty) {
+        free_blocks(b->order)->push_front(b);
+    } else {
+        free_blocks(b->order)->push_back(b);
+        nfree_clean_pages += 1UL << (b->order - MIN_ORDER);
+    }
+}
+
+static void freelist_erase(pagestate* b) {
+    assert(freemap_test(b->order, b->pindex));
+    freemap_flip(b->order, b->pindex);
+    auto lst = free_blocks(b->order);
+    lst->erase(b);
+    if (lst->empty()) {
+        nonempty_orders &= ~(1U << (b->order - MIN_ORDER));
+    }
+    nfree_pages -= 1UL << (b->order - MIN_ORDER);
+    if (!b->dirty) {
+        nfree_clean_pages -= 1UL << (b->order - MIN_ORDER);
+    }
+}
+
+
 // order_of(size)
 //    Returns the smallest order of size
 static int order_of(int n) {
@@ -44,8 +134,12 @@ static int order_of(int n) {
 }
 
 
+static void* kalloc_block(size_t sz, bool zeroed, void* site);
+
 x86_64_page* kallocpage() {
-    return reinterpret_cast<x86_64_page*>(kalloc(PAGESIZE));
+    return reinterpret_cast<x86_64_page*>(
+        kalloc_block(PAGESIZE, false, __builtin_return_address(0))
+    );
     // auto irqs = page_lock.lock();
 
     // x86_64_page* p = nullptr;
@@ -69,6 +163,12 @@ x86_64_page* kallocpage() {
     // return p;
 }
 
+x86_64_page* kallocpage_zeroed() {
+    return reinterpret_cast<x86_64_page*>(
+        kalloc_block(PAGESIZE, true, __builtin_return_address(0))
+    );
+}
+
 
 // find_max_order(addr)
 //    Determine the largest order buddy-allocator block creatable at this
@@ -104,20 +204,72 @@ void print_all_block_lists() {
 }
 
 
+// init_kalloc_metadata()
+//    Size `pages` and the bitmaps for `memsize_physical`, carve them
+//    out of available physical memory, and mark that memory as kernel
+//    memory in `physical_ranges`.
+static void init_kalloc_metadata() {
+    npages = memsize_physical / PAGESIZE;
+    size_t fmwords = 0;
+    for (int order = MIN_ORDER; order <= MAX_ORDER; ++order) {
+        fmwords += FREEMAP_WORDS(order);
+    }
+    fmwords += FREEMAP_WORDS(MIN_ORDER);    // movemap
+    size_t metasz = npages * sizeof(pagestate) + fmwords * sizeof(uint64_t);
+#if KALLOC_TRACK
+    metasz = ROUNDUP(metasz, alignof(alloctag)) + npages * sizeof(alloctag);
+#endif
+    metasz = ROUNDUP(metasz, PAGESIZE);
+
+    // use the first available range above 1 MiB that fits
+    uintptr_t metapa = 0;
+    for (auto range = physical_ranges.begin();
+         range != physical_ranges.end() && !metapa;
+         ++range) {
+        uintptr_t first = ROUNDUP(range->first(), PAGESIZE);
+        if (range->type() == mem_available
+            && first >= PA_IOLOWEND
+            && first + metasz <= range->last()) {
+            metapa = first;
+        }
+    }
+    assert(metapa != 0 && "no room for page metadata");
+    bool ok = physical_ranges.set(metapa, metapa + metasz, mem_kernel);
+    assert(ok);
+
+    memset(pa2ka<void*>(metapa), 0, metasz);
+    pages = pa2ka<pagestate*>(metapa);
+    uint64_t* fm = reinterpret_cast<uint64_t*>(&pages[npages]);
+    for (int order = MIN_ORDER; order <= MAX_ORDER; ++order) {
+        freemaps[order - MIN_ORDER] = fm;
+        fm += FREEMAP_WORDS(order);
+    }
+    movemap = fm;
+    fm += FREEMAP_WORDS(MIN_ORDER);
+#if KALLOC_TRACK
+    tags = reinterpret_cast<alloctag*>(
+        ROUNDUP(reinterpret_cast<uintptr_t>(fm), alignof(alloctag))
+    );
+#endif
+}
+
+
 // init_kalloc
 //    Initialize stuff needed by `kalloc`. Called from `init_hardware`,
 //    after `physical_ranges` is initialized.
 void init_kalloc() {
     log_printf("initializing kalloc... ");
-    memset(pages, 0, sizeof(pages));
+    init_kalloc_metadata();
 
     for (auto range = physical_ranges.begin();
-     range->first() < MEMSIZE_PHYSICAL;
-     ++range) {
+         range != physical_ranges.end()
+             && range->first() < memsize_physical;
+         ++range) {
         auto addr = range->first();
-        while(addr < range->last()) {
+        auto end = min(range->last(), memsize_physical);
+        while(addr < end) {
             // find the largest buddy-allocation chunk we can make here
-            int order = find_max_order(addr, range->last());
+            int order = find_max_order(addr, end);
             if (order > 0) {
                 int pindex = addr / PAGESIZE;
                 pages[pindex].order = order;
@@ -126,8 +278,10 @@ void init_kalloc() {
                 // is the chunk allocated?
                 if (range->type() == mem_available) {
                     pages[pindex].allocated = false;
+                    // boot leaves memory contents unknown
+                    pages[pindex].dirty = true;
                     // add the available block to the free_blocks lists
-                    free_blocks(order)->push_back(&pages[pindex]);
+                    freelist_push(&pages[pindex]);
                 }
                 else {
                     pages[pindex].allocated = true;
@@ -140,147 +294,855 @@ void init_kalloc() {
             }
         }
     }
-    log_printf("finished\n");
+    init_slab();
+    log_printf("finished: %zu MiB, %zu KiB page metadata\n",
+               memsize_physical >> 20,
+               (npages * sizeof(pagestate)) >> 10);
 }
 
 // min_larger_order
 //    Finds the smallest order block that can be broken up to eventually
-//    get blocks of goal order size
+//    get blocks of goal order size. Returns -1 if there is none.
 static int min_larger_order(int order) {
-    int test_order = order;
-    while (free_blocks(test_order)->empty()) {
-        ++test_order;
-        if (test_order > MAX_ORDER) return -1;
+    unsigned mask = nonempty_orders & (~0U << (order - MIN_ORDER));
+    if (!mask) return -1;
+    return MIN_ORDER + lsb(mask) - 1;
+}
+
+
+// buddy_alloc(order, clean)
+//    Remove and return a free block of `order` from the free lists,
+//    splitting a larger block if needed. Prefers clean blocks if `clean`
+//    is true and dirty blocks otherwise. Returns `nullptr` if no block is
+//    available. Requires `page_lock`.
+static pagestate* buddy_alloc(int order, bool clean) {
+    int larger_order = min_larger_order(order);
+    if (larger_order < 0) {
+        // debug_printf("buddy_alloc(%d): no free block, returning "
+        //     "nullptr\n", order);
+        return nullptr;
     }
-    assert(test_order <= MAX_ORDER);
-    return test_order;
+
+    auto lst = free_blocks(larger_order);
+    pagestate* block = clean ? lst->back() : lst->front();
+    freelist_erase(block);
+
+    // break the block down in one pass, freeing its upper halves
+    while (block->order > order) {
+        block->order--;
+        int new_pindex = block->pindex + (1 << (block->order - MIN_ORDER));
+        pagestate* new_block = &pages[new_pindex];
+        new_block->order = block->order;
+        new_block->allocated = false;
+        new_block->dirty = block->dirty;
+        new_block->pindex = new_pindex;
+        freelist_push(new_block);
+    }
+
+    block->allocated = true;
+    return block;
 }
 
 
-// kalloc(sz)
-//    Allocate and return a pointer to at least `sz` contiguous bytes
-//    of memory. Returns `nullptr` if `sz == 0` or on failure.
-void* kalloc(size_t sz) {
-    if (!sz) return nullptr;
-    sz = MAX(sz, 1U << MIN_ORDER);
+// buddy_pindex(p, order)
+//    Returns the pindex of the buddy block
+static int buddy_pindex(int p, int order) {
+    return p ^ (1 << (order - MIN_ORDER));
+}
 
-    int order = order_of(sz) < MIN_ORDER ? MIN_ORDER : order_of(sz);
-    if (order > MAX_ORDER) {
-        // debug_printf("Order %d too big, returning nullptr\n", order);
-        return nullptr;
+
+// buddy_free(pindex)
+//    Return the allocated block starting at `pindex` to the free lists,
+//    coalescing it with free buddies. The block's `dirty` flag must be
+//    set correctly. Requires `page_lock`.
+static void buddy_free(int pindex) {
+    pages[pindex].allocated = false;
+
+    while (true) {
+        // find buddy address
+        int order = pages[pindex].order;
+        if (order == MAX_ORDER) {
+            break;
+        }
+        int b_pindex = buddy_pindex(pindex, order);
+        if (b_pindex >= (int) npages || !freemap_test(order, b_pindex)) {
+            break;
+        }
+        // buddy is not allocated and is the same order past here
+
+        auto to_merge = MAX(pindex, b_pindex);
+        auto merge_base = MIN(pindex, b_pindex);
+
+        // wipe merged block from existence and coalesce
+        freelist_erase(&pages[b_pindex]);
+        bool dirty = pages[pindex].dirty || pages[b_pindex].dirty;
+        memset(&pages[to_merge], 0, sizeof(pagestate));
+        pages[merge_base].order++;
+        pages[merge_base].dirty = dirty;
+
+        pindex = merge_base;
+    }
+
+    freelist_push(&pages[pindex]);
+}
+
+
+// per-CPU page magazines
+//    Each CPU keeps a stack of free order-12 pages, linked through their
+//    first word, so most `kallocpage`/`kfree` calls skip `page_lock`.
+//    Magazine pages stay marked allocated in `pages` (so buddies don't
+//    coalesce with them) and have `cached` set. The link word is cleared
+//    when a page leaves the magazine, so clean pages stay clean. The
+//    magazine is refilled and drained `MAGAZINE_BATCH` pages at a time
+//    under `page_lock`.
+#define MAGAZINE_BATCH 16
+#define MAGAZINE_MAX (3 * MAGAZINE_BATCH)
+
+// magazine_push(c, pindex), magazine_pop(c)
+//    Add or remove a page from `c`'s magazine. Require disabled interrupts.
+static void magazine_push(cpustate* c, int pindex) {
+    x86_64_page* pg = pa2ka<x86_64_page*>(pindex * PAGESIZE);
+    *reinterpret_cast<x86_64_page**>(pg) = c->page_magazine_;
+    c->page_magazine_ = pg;
+    ++c->npage_magazine_;
+    pages[pindex].cached = true;
+}
+
+static int magazine_pop(cpustate* c) {
+    x86_64_page* pg = c->page_magazine_;
+    c->page_magazine_ = *reinterpret_cast<x86_64_page**>(pg);
+    *reinterpret_cast<x86_64_page**>(pg) = nullptr;
+    --c->npage_magazine_;
+    int pindex = ka2pa(pg) / PAGESIZE;
+    pages[pindex].cached = false;
+    return pindex;
+}
+
+// magazine_drain(c, n)
+//    Return up to `n` pages from `c`'s magazine to the buddy allocator.
+//    Requires disabled interrupts.
+static void magazine_drain(cpustate* c, unsigned n) {
+    page_lock.lock_noirq();
+    while (n != 0 && c->page_magazine_) {
+        int pindex = magazine_pop(c);
+        buddy_free(pindex);
+        --n;
+    }
+    page_lock.unlock_noirq();
+}
+
+// magazine_alloc(zeroed)
+//    Return a free page from this CPU's magazine, refilling it from the
+//    buddy allocator if it is empty. The page is zeroed if `zeroed` is
+//    true. Returns `nullptr` on failure.
+static void* magazine_alloc(bool zeroed) {
+    irqstate irqs = irqstate::get();
+    cli();
+    cpustate* c = this_cpu();
+    if (!c->page_magazine_) {
+        page_lock.lock_noirq();
+        for (int i = 0; i != MAGAZINE_BATCH; ++i) {
+            pagestate* ps = buddy_alloc(MIN_ORDER, zeroed);
+            if (!ps) {
+                break;
+            }
+            magazine_push(c, ps->pindex);
+        }
+        page_lock.unlock_noirq();
+    }
+    void* ptr = nullptr;
+    bool dirty = false;
+    if (c->page_magazine_) {
+        int pindex = magazine_pop(c);
+        ptr = pa2ka<void*>(pindex * PAGESIZE);
+        dirty = pages[pindex].dirty;
     }
+    irqs.restore();
+
+    if (ptr && zeroed && dirty) {
+        memset(ptr, 0, PAGESIZE);
+    }
+    return ptr;
+}
+
+
+#if KALLOC_TRACK
+// track_alloc(pindex, site)
+//    Record that the block at `pindex` was just allocated from `site`.
+static void track_alloc(int pindex, void* site) {
+    tags[pindex].site = reinterpret_cast<uintptr_t>(site);
+    proc* p = current();
+    tags[pindex].pid = p ? p->true_pid_ : -1;
+}
+
+
+// kalloc_dump()
+//    Log live page allocations grouped by call site and by process.
+void kalloc_dump() {
+    static constexpr int nsites = 64;
+    static struct {
+        uintptr_t site;
+        size_t bytes;
+        size_t count;
+    } sites[nsites];
+    static size_t pid_bytes[NPROC + 1];     // last slot: kernel tasks
+    static spinlock dump_lock;
+
+    auto dump_irqs = dump_lock.lock();
+    memset(sites, 0, sizeof(sites));
+    memset(pid_bytes, 0, sizeof(pid_bytes));
+    size_t other_bytes = 0;
 
     auto irqs = page_lock.lock();
+    for (uintptr_t addr = 0; addr < memsize_physical; ) {
+        pagestate* b = &pages[addr / PAGESIZE];
+        size_t bytes = 1UL << b->order;
+        addr += bytes;
+        if (!b->allocated || b->cached || !tags[b->pindex].site) {
+            continue;
+        }
+        auto& tag = tags[b->pindex];
+        int i = 0;
+        while (i != nsites && sites[i].site && sites[i].site != tag.site) {
+            ++i;
+        }
+        if (i == nsites) {
+            other_bytes += bytes;
+        } else {
+            sites[i].site = tag.site;
+            sites[i].bytes += bytes;
+            ++sites[i].count;
+        }
+        pid_bytes[tag.pid >= 0 && tag.pid < NPROC ? tag.pid : NPROC] += bytes;
+    }
+    page_lock.unlock(irqs);
 
-    // order of largest block to be broken up
-    int largest_min_order = min_larger_order(order);
-    if (largest_min_order < 0 || largest_min_order > MAX_ORDER) {
-        page_lock.unlock(irqs);
-        // debug_printf("kalloc(%d): largest_min_order %d invalid, returning "
-        //     "nullptr\n", sz, largest_min_order);
+    log_printf("kalloc: live allocations by call site\n");
+    for (int i = 0; i != nsites && sites[i].site; ++i) {
+        const char* name;
+        uintptr_t start;
+        if (lookup_symbol(sites[i].site, &name, &start)) {
+            log_printf("  %8zu KiB %6zu blocks  %s+%zu\n",
+                       sites[i].bytes >> 10, sites[i].count,
+                       name, sites[i].site - start);
+        } else {
+            log_printf("  %8zu KiB %6zu blocks  %p\n",
+                       sites[i].bytes >> 10, sites[i].count,
+                       sites[i].site);
+        }
+    }
+    if (other_bytes) {
+        log_printf("  %8zu KiB (other sites)\n", other_bytes >> 10);
+    }
+    log_printf("kalloc: live allocations by process\n");
+    for (int pid = 0; pid != NPROC + 1; ++pid) {
+        if (pid_bytes[pid] && pid == NPROC) {
+            log_printf("  %8zu KiB  kernel\n", pid_bytes[pid] >> 10);
+        } else if (pid_bytes[pid]) {
+            log_printf("  %8zu KiB  pid %d\n", pid_bytes[pid] >> 10, pid);
+        }
+    }
+    dump_lock.unlock(dump_irqs);
+}
+#endif
+
+
+// shrinkers and background reclaim
+//    Registered shrinkers are called when an allocation fails, and by the
+//    reclaim task when free memory drops below `RECLAIM_LOW_PAGES`; the
+//    reclaim task tries to get back to `RECLAIM_HIGH_PAGES`, evicting
+//    user pages to swap if the shrinkers can't.
+#define RECLAIM_LOW_PAGES (npages / 32)
+#define RECLAIM_HIGH_PAGES (npages / 16)
+
+static spinlock shrinker_lock;
+static shrinker* shrinkers;
+static std::atomic_flag shrinking = ATOMIC_FLAG_INIT;
+static std::atomic<bool> reclaim_wanted;
+static wait_queue reclaim_wq;
+
+
+// register_shrinker(s)
+//    Add `s` to the shrinkers called under memory pressure.
+void register_shrinker(shrinker* s) {
+    assert(s->shrink_);
+    auto irqs = shrinker_lock.lock();
+    s->next_ = shrinkers;
+    shrinkers = s;
+    shrinker_lock.unlock(irqs);
+}
+
+
+// run_shrinkers(want)
+//    Ask registered shrinkers to free about `want` pages. Returns the
+//    number of pages freed. Only one CPU shrinks at a time; others (and
+//    allocations made by shrinkers themselves) get 0.
+size_t run_shrinkers(size_t want) {
+    if (shrinking.test_and_set()) {
+        return 0;
+    }
+    // shrinkers are only ever added, so the list can be walked unlocked
+    size_t freed = 0;
+    for (shrinker* s = shrinkers; s && freed < want; s = s->next_) {
+        freed += s->shrink_(want - freed);
+    }
+    shrinking.clear();
+    return freed;
+}
+
+
+// reclaim_task
+//    Kernel task that runs the shrinkers when free memory runs low.
+static void reclaim_task(proc*) {
+    while (true) {
+        waiter(current()).block_until(reclaim_wq, [] () {
+            return reclaim_wanted.load();
+        });
+        reclaim_wanted = false;
+        size_t nfree = nfree_pages;
+        if (nfree < RECLAIM_HIGH_PAGES) {
+            run_shrinkers(RECLAIM_HIGH_PAGES - nfree);
+        }
+        // evict user pages if caches weren't enough; this blocks, which
+        // shrinkers called from `kalloc` can't
+        nfree = nfree_pages;
+        if (nfree < RECLAIM_HIGH_PAGES) {
+            vmregion_swap_out(RECLAIM_HIGH_PAGES - nfree);
+        }
+    }
+}
+
+
+// init_reclaim
+//    Start the reclaim task on CPU 0. Called from `init_hardware`.
+void init_reclaim() {
+    proc* p = kalloc_proc();
+    assert(p);
+    p->init_kernel(-1, reclaim_task);
+    p->cpu_ = 0;
+    auto irqs = cpus[0].runq_lock_.lock();
+    cpus[0].enqueue(p);
+    cpus[0].runq_lock_.unlock(irqs);
+}
+
+
+// memory compaction
+//    When a large allocation fails because free memory is fragmented,
+//    `compact` empties one aligned region of the wanted order by moving
+//    the user pages in it elsewhere, then returns the region as a single
+//    allocated block. A page is movable if it is an order-12 block mapped
+//    writable by a user page table; `process_fork` copies such pages, so
+//    that page table is the only reference. `compact` only changes page
+//    tables that no CPU is running and holds every run queue lock while
+//    it works, so none of them can start running. No shootdown is needed;
+//    `invalidate_pagetables` keeps CPUs from reusing translations they
+//    cached for those page tables earlier.
+#define COMPACT_MIN_ORDER (MIN_ORDER + 4)
+
+static void* kalloc_try(int order, bool zeroed);
+
+static bool movemap_test(int pindex) {
+    return movemap[pindex / 64] & (1UL << (pindex % 64));
+}
+
+// page_movable(pindex)
+//    Return true if the page at `pindex` is an allocated order-12 block
+//    that `compact` may move. Requires `page_lock`.
+static bool page_movable(int pindex) {
+    pagestate* b = &pages[pindex];
+    return b->allocated && !b->cached && !b->isolated && !b->extra_refs
+        && b->order == MIN_ORDER && b->pindex == pindex
+        && movemap_test(pindex);
+}
+
+// compact_pagetables(f)
+//    Call `f(pt)` for each user page table that `compact` may change.
+//    Requires `ptable_lock` and every run queue lock.
+template <typename F>
+static void compact_pagetables(F f) {
+    for (pid_t pid = 1; pid != NPROC; ++pid) {
+        proc* p = ptable[pid];
+        // skip processes that are being set up or torn down
+        if (!p || !p->pagetable_ || p->pagetable_ == early_pagetable
+            || !(p->state_ == proc::blocked || p->runq_link_.is_linked())) {
+            continue;
+        }
+        bool running = false;
+        for (int i = 0; i != ncpu; ++i) {
+            proc* cp = cpus[i].current_;
+            running = running || (cp && cp->pagetable_ == p->pagetable_);
+        }
+        if (!running) {
+            f(p->pagetable_);
+        }
+    }
+}
+
+// compact_pick(order)
+//    Return the pindex of the aligned `order` region that needs the fewest
+//    page moves to become free, or -1 if no region can be emptied. Every
+//    block in the region must be free or movable. Requires `page_lock`.
+static int compact_pick(int order) {
+    int n = 1 << (order - MIN_ORDER);
+    int best = -1;
+    int best_moves = n;
+    for (int region = 0; region + n <= int(npages); region += n) {
+        int moves = 0;
+        for (int p = region; p < region + n && moves < best_moves; ) {
+            pagestate* b = &pages[p];
+            if (b->allocated ? !page_movable(p) : b->order > order) {
+                moves = n;
+                break;
+            }
+            moves += b->allocated;
+            p += 1 << (b->order - MIN_ORDER);
+        }
+        // moved pages must fit in free memory outside the region
+        if (moves < best_moves
+            && size_t(moves) <= nfree_pages - (n - moves)) {
+            best = region;
+            best_moves = moves;
+        }
+    }
+    return best;
+}
+
+// compact_isolate(region, n)
+//    Take every free block in the `n`-page region at `region` off the free
+//    lists, so moved pages can't land there. Requires `page_lock`.
+static void compact_isolate(int region, int n) {
+    for (int p = region; p < region + n; ) {
+        pagestate* b = &pages[p];
+        if (!b->allocated) {
+            freelist_erase(b);
+            b->allocated = b->isolated = true;
+        }
+        p += 1 << (b->order - MIN_ORDER);
+    }
+}
+
+// compact_migrate(pt, region, n)
+//    Move the movable pages `pt` maps from the `n`-page region at
+//    `region` to new pages. Returns false if a page can't be allocated.
+static bool compact_migrate(x86_64_pagetable* pt, int region, int n) {
+    for (vmiter it(pt); it.low(); it.next()) {
+        int pindex = it.pa() / PAGESIZE;
+        if (!it.user() || !it.writable() || it.huge()
+            || pindex < region || pindex >= region + n) {
+            continue;
+        }
+        page_lock.lock_noirq();
+        bool movable = page_movable(pindex);
+        page_lock.unlock_noirq();
+        if (!movable) {
+            continue;
+        }
+
+        void* npg = kalloc_try(MIN_ORDER, false);
+        if (!npg) {
+            return false;
+        }
+        memcpy(npg, it.ka<void*>(), PAGESIZE);
+        // keep every flag: dirty, copy-on-write, shared, caching, XD
+        int r = it.map(ka2pa(npg), it.flags());
+        assert(r == 0);
+
+        page_lock.lock_noirq();
+        pages[pindex].isolated = pages[pindex].dirty = true;
+        page_lock.unlock_noirq();
+    }
+    return true;
+}
+
+// compact_finish(region, order)
+//    Turn the region at `region` into one allocated block of `order` and
+//    return it. If something else still holds part of the region, give
+//    back what `compact` holds and return `nullptr`. Requires `page_lock`.
+static pagestate* compact_finish(int region, int order) {
+    int n = 1 << (order - MIN_ORDER);
+    // catch blocks freed into the region in the meantime
+    compact_isolate(region, n);
+
+    bool complete = true;
+    for (int p = region; p < region + n; ) {
+        complete = complete && pages[p].isolated;
+        p += 1 << (pages[p].order - MIN_ORDER);
+    }
+
+    if (!complete) {
+        for (int p = region; p < region + n; ) {
+            pagestate* b = &pages[p];
+            int next = p + (1 << (b->order - MIN_ORDER));
+            if (b->isolated) {
+                b->isolated = false;
+                buddy_free(p);
+            }
+            p = next;
+        }
         return nullptr;
     }
 
-    // break up blocks if necessary
-    while (free_blocks(order)->empty()) {
-        int larger_order = min_larger_order(order);
+    memset(&pages[region + 1], 0, (n - 1) * sizeof(pagestate));
+    pagestate* block = &pages[region];
+    block->order = order;
+    block->allocated = true;
+    block->isolated = false;
+    block->dirty = true;
+    return block;
+}
 
-        // block to be broken in half
-        pagestate* target_block = free_blocks(larger_order)->pop_front();
-        target_block->order--;
-        free_blocks(larger_order - 1)->push_back(target_block);
+// compact(order)
+//    Try to produce a free block of `order` by moving user pages. Returns
+//    the block, already allocated, or `nullptr` on failure. Gives up if
+//    any lock it needs is busy, since the caller may hold one of them.
+static pagestate* compact(int order) {
+    irqstate irqs;
+    if (!ptable_lock.trylock(irqs)) {
+        return nullptr;
+    }
+    int nlocked = 0;
+    while (nlocked != ncpu && cpus[nlocked].runq_lock_.trylock_noirq()) {
+        ++nlocked;
+    }
 
-        // second half of split larger block
-        int new_pindex = target_block->pindex +
-            (1 << (target_block->order - order_of(PAGESIZE)));
-        pagestate* new_block = &pages[new_pindex];
+    pagestate* block = nullptr;
+    if (nlocked == ncpu) {
+        memset(movemap, 0, FREEMAP_WORDS(MIN_ORDER) * sizeof(uint64_t));
+        compact_pagetables([] (x86_64_pagetable* pt) {
+            for (vmiter it(pt); it.low(); it.next()) {
+                if (it.user() && it.writable() && !it.huge()
+                    && it.pa() < npages * PAGESIZE
+                    && physical_ranges.type(it.pa()) == mem_available) {
+                    int pindex = it.pa() / PAGESIZE;
+                    movemap[pindex / 64] |= 1UL << (pindex % 64);
+                }
+            }
+        });
 
-        // put new block info into pages array
-        new_block->order = target_block->order;
-        new_block->allocated = false;
-        new_block->pindex = new_pindex;
-        // put new block into free blocks lists
-        free_blocks(new_block->order)->push_back(new_block);
+        int n = 1 << (order - MIN_ORDER);
+        page_lock.lock_noirq();
+        int region = compact_pick(order);
+        if (region >= 0) {
+            compact_isolate(region, n);
+        }
+        page_lock.unlock_noirq();
+
+        if (region >= 0) {
+            bool ok = true;
+            compact_pagetables([&] (x86_64_pagetable* pt) {
+                ok = ok && compact_migrate(pt, region, n);
+            });
+            invalidate_pagetables();
+            page_lock.lock_noirq();
+            block = compact_finish(region, order);
+            page_lock.unlock_noirq();
+        }
+    }
+
+    while (nlocked != 0) {
+        --nlocked;
+        cpus[nlocked].runq_lock_.unlock_noirq();
+    }
+    ptable_lock.unlock(irqs);
+    return block;
+}
+
+
+// kalloc_try(order, zeroed)
+//    Allocate a block of `order` without running shrinkers. Returns
+//    `nullptr` on failure.
+static void* kalloc_try(int order, bool zeroed) {
+    if (order == MIN_ORDER) {
+        return magazine_alloc(zeroed);
     }
 
-    pagestate* free_block = free_blocks(order)->pop_front();
-    free_block->allocated = true;
+    auto irqs = page_lock.lock();
+    pagestate* block = buddy_alloc(order, zeroed);
+    if (!block && this_cpu()->page_magazine_) {
+        // pages parked in this CPU's magazine may complete a larger block
+        page_lock.unlock_noirq();
+        magazine_drain(this_cpu(), MAGAZINE_MAX);
+        page_lock.lock_noirq();
+        block = buddy_alloc(order, zeroed);
+    }
     page_lock.unlock(irqs);
-    return pa2ka<void*>(free_block->pindex * PAGESIZE);
+
+    if (!block) {
+        return nullptr;
+    }
+    void* ptr = pa2ka<void*>(block->pindex * PAGESIZE);
+    if (zeroed && block->dirty) {
+        memset(ptr, 0, 1UL << order);
+    }
+    return ptr;
 }
 
-// buddy_pindex(p, order)
-//    Returns the pindex of the buddy block
-static int buddy_pindex(int p, int order) {
-    p *= PAGESIZE;
-    if (p % (1 << (order + 1)) == 0) {
-        return (p + (1 << order)) / PAGESIZE;
+
+// kalloc_block(sz, zeroed, site)
+//    Shared implementation of `kalloc` and `kalloc_zeroed`. `site` is the
+//    caller's return address, recorded if allocation tracking is on.
+static void* kalloc_block(size_t sz, bool zeroed, void* site) {
+    if (!sz) return nullptr;
+    sz = MAX(sz, 1U << MIN_ORDER);
+
+    int order = order_of(sz) < MIN_ORDER ? MIN_ORDER : order_of(sz);
+    if (order > MAX_ORDER) {
+        // debug_printf("Order %d too big, returning nullptr\n", order);
+        return nullptr;
     }
-    else {
-        return (p - (1 << order)) / PAGESIZE;
+
+    void* ptr = kalloc_try(order, zeroed);
+    if (!ptr && run_shrinkers(1UL << (order - MIN_ORDER))) {
+        ptr = kalloc_try(order, zeroed);
+    }
+    if (!ptr && order >= COMPACT_MIN_ORDER) {
+        // free memory may be there but fragmented
+        if (pagestate* block = compact(order)) {
+            ptr = pa2ka<void*>(block->pindex * PAGESIZE);
+            if (zeroed) {
+                memset(ptr, 0, 1UL << order);
+            }
+        }
+    }
+
+    // wake the reclaim task if memory is getting low
+    if (nfree_pages < RECLAIM_LOW_PAGES && !reclaim_wanted.exchange(true)) {
+        reclaim_wq.wake_all();
+    }
+#if KALLOC_TRACK
+    if (ptr) {
+        track_alloc(ka2pa(ptr) / PAGESIZE, site);
     }
+#else
+    (void) site;
+#endif
+    return ptr;
+}
+
+
+// kalloc(sz)
+//    Allocate and return a pointer to at least `sz` contiguous bytes
+//    of memory. Returns `nullptr` if `sz == 0` or on failure. The memory
+//    may contain stale data.
+void* kalloc(size_t sz) {
+    return kalloc_block(sz, false, __builtin_return_address(0));
+}
+
+
+// kalloc_zeroed(sz)
+//    Like `kalloc`, but the returned memory is zeroed.
+void* kalloc_zeroed(size_t sz) {
+    return kalloc_block(sz, true, __builtin_return_address(0));
 }
 
 
 // kfree(ptr)
-//    Free a pointer previously returned by `kalloc`, `kallocpage`, or
-//    `kalloc_pagetable`. Does nothing if `ptr == nullptr`.
+//    Free a pointer previously returned by `kalloc`, `kallocpage`,
+//    `kalloc_slab`, or `kalloc_pagetable`. Does nothing if `ptr == nullptr`.
 void kfree(void* ptr) {
     if (ptr == nullptr) return;
 
+    // small objects live inside slab pages
     if (ka2pa(ptr) % PAGESIZE != 0) {
-        log_printf("BAD FREE: pa %p va %p\n", ka2pa(ptr), ptr);
+        kfree_slab(ptr);
+        return;
     }
-    assert(ka2pa(ptr) % PAGESIZE == 0);
 
-    auto irqs = page_lock.lock();
     int pindex = ka2pa(ptr) / PAGESIZE;
-    if (!pages[pindex].allocated) {
+    if (!pages[pindex].allocated || pages[pindex].cached) {
         debug_printf("bad free: %p\n", ptr);
+#if KALLOC_TRACK
+        log_printf("kfree: bad free of %p from %p, last allocated at %p\n",
+                   ptr, __builtin_return_address(0), tags[pindex].site);
+#endif
+        // hack for DOOM's huge memory usage breaking the allocator
+        // log_printf("WARNING: free of %p failed\n", ptr);
+        return;
     }
 
-    // hack for DOOM's huge memory usage breaking the allocator
-    if (!pages[pindex].allocated) {
+    // drop one reference to a shared block
+    if (pages[pindex].extra_refs) {
+        auto irqs = page_lock.lock();
+        bool shared = pages[pindex].extra_refs > 0;
+        if (shared) {
+            --pages[pindex].extra_refs;
+        }
         page_lock.unlock(irqs);
-        // log_printf("WARNING: free of %p failed\n", ptr);
-        return;
+        if (shared) {
+            return;
+        }
     }
-    // assert(pages[pindex].allocated);
+#if KALLOC_TRACK
+    tags[pindex].site = 0;
+#endif
 
-    // free the memory
-    pages[pindex].allocated = false;
-    memset(ptr, 0, (1 << pages[pindex].order));
+    // free the memory; it is zeroed on demand or by the idle task
+    pages[pindex].dirty = true;
+
+    if (pages[pindex].order == MIN_ORDER) {
+        irqstate irqs = irqstate::get();
+        cli();
+        cpustate* c = this_cpu();
+        magazine_push(c, pindex);
+        if (c->npage_magazine_ > MAGAZINE_MAX) {
+            magazine_drain(c, MAGAZINE_BATCH);
+        }
+        irqs.restore();
+        return;
+    }
 
     // log_printf("BEFORE FREE pindex=%d:\n", pindex);
     // print_all_block_lists();
 
-    while (true) {
-        // find buddy address
-        int b_pindex = buddy_pindex(pindex, pages[pindex].order);
+    auto irqs = page_lock.lock();
+    buddy_free(pindex);
 
-        if (pages[b_pindex].allocated
-            || pages[b_pindex].order != pages[pindex].order
-            || pages[pindex].order == MAX_ORDER) {
-            break;
+    // log_printf("AFTER FREE:\n");
+    // print_all_block_lists();
+    page_lock.unlock(irqs);
+}
+
+
+// kfree_batch(ptrs, n)
+//    Free `n` pointers as if by `kfree`. Unshared single pages go to this
+//    CPU's magazine with interrupts disabled once for the whole batch,
+//    and any overflow returns to the buddy allocator under one
+//    `page_lock` acquisition.
+void kfree_batch(void* const* ptrs, size_t n) {
+    irqstate irqs = irqstate::get();
+    cli();
+    cpustate* c = this_cpu();
+    for (size_t i = 0; i != n; ++i) {
+        uintptr_t pa = ka2pa(ptrs[i]);
+        int pindex = pa / PAGESIZE;
+        if (!ptrs[i] || pa % PAGESIZE != 0
+            || !pages[pindex].allocated || pages[pindex].cached
+            || pages[pindex].extra_refs
+            || pages[pindex].order != MIN_ORDER) {
+            kfree(ptrs[i]);
+            continue;
         }
-        // buddy is not allocated and is the same order past here
+#if KALLOC_TRACK
+        tags[pindex].site = 0;
+#endif
+        pages[pindex].dirty = true;
+        magazine_push(c, pindex);
+    }
+    if (c->npage_magazine_ > MAGAZINE_MAX) {
+        magazine_drain(c, c->npage_magazine_ - MAGAZINE_MAX + MAGAZINE_BATCH);
+    }
+    irqs.restore();
+}
 
-        auto to_merge = MAX(pindex, b_pindex);
-        auto merge_base = MIN(pindex, b_pindex);
 
-        // wipe merged block from existence and coalesce
-        free_blocks(pages[b_pindex].order)->erase(&pages[b_pindex]);
-        memset(&pages[to_merge], 0, sizeof(pagestate));
-        pages[merge_base].order++;
+// kalloc_size(ptr)
+//    Return the size of the allocated block at `ptr`, or 0 if there is none.
+size_t kalloc_size(void* ptr) {
+    uintptr_t pa = ka2pa(ptr);
+    if (pa % PAGESIZE != 0 || pa >= npages * PAGESIZE
+        || physical_ranges.type(pa) != mem_available) {
+        return 0;
+    }
+    pagestate* b = &pages[pa / PAGESIZE];
+    if (!b->allocated || b->cached || b->pindex != int(pa / PAGESIZE)) {
+        return 0;
+    }
+    return 1UL << b->order;
+}
 
-        pindex = merge_base;
+
+// kalloc_split(ptr)
+//    Turn the allocated block at `ptr` into `MIN_ORDER` blocks, each of
+//    which can later be passed to `kfree`. They coalesce again once all
+//    of them are free.
+void kalloc_split(void* ptr) {
+    int pindex = ka2pa(ptr) / PAGESIZE;
+    auto irqs = page_lock.lock();
+    pagestate* b = &pages[pindex];
+    assert(b->allocated && !b->cached && b->pindex == pindex);
+    int n = 1 << (b->order - MIN_ORDER);
+    for (int i = 1; i != n; ++i) {
+        pagestate* sub = &pages[pindex + i];
+        sub->order = MIN_ORDER;
+        sub->pindex = pindex + i;
+        sub->allocated = true;
+        sub->cached = false;
+        sub->dirty = b->dirty;
+#if KALLOC_TRACK
+        tags[pindex + i] = tags[pindex];
+#endif
     }
+    b->order = MIN_ORDER;
+    page_lock.unlock(irqs);
+}
 
-    free_blocks(pages[pindex].order)->push_back(&pages[pindex]);
 
-    // log_printf("AFTER FREE:\n");
-    // print_all_block_lists();
+// kalloc_ref(ptr)
+//    Add a reference to the allocated block at `ptr`. The block is freed
+//    by the `kfree` that drops its last reference.
+void kalloc_ref(void* ptr) {
+    int pindex = ka2pa(ptr) / PAGESIZE;
+    auto irqs = page_lock.lock();
+    assert(pages[pindex].allocated && !pages[pindex].cached
+           && pages[pindex].pindex == pindex);
+    ++pages[pindex].extra_refs;
+    page_lock.unlock(irqs);
+}
+
+
+// kalloc_shared(ptr)
+//    Return true if the block at `ptr` has more than one reference.
+bool kalloc_shared(void* ptr) {
+    auto irqs = page_lock.lock();
+    bool shared = pages[ka2pa(ptr) / PAGESIZE].extra_refs > 0;
+    page_lock.unlock(irqs);
+    return shared;
+}
+
+
+// kalloc_prezero()
+//    Zero one dirty free block, so later `kalloc_zeroed` calls find clean
+//    memory. Does nothing once `PREZERO_TARGET` free pages are clean.
+//    Returns true if it zeroed something. Called from the idle task.
+bool kalloc_prezero() {
+    auto irqs = page_lock.lock();
+    pagestate* block = nullptr;
+    if (nfree_clean_pages < PREZERO_TARGET) {
+        for (int order = MIN_ORDER; order <= MAX_ORDER && !block; ++order) {
+            pagestate* b = free_blocks(order)->front();
+            if (b && b->dirty) {
+                block = b;
+            }
+        }
+    }
+    if (!block) {
+        page_lock.unlock(irqs);
+        return false;
+    }
+
+    // take the block off the free lists, splitting off upper halves
+    // so that it isn't too big to zero in one go
+    freelist_erase(block);
+    while (block->order > PREZERO_MAX_ORDER) {
+        --block->order;
+        int b_pindex = block->pindex + (1 << (block->order - MIN_ORDER));
+        pages[b_pindex].order = block->order;
+        pages[b_pindex].pindex = b_pindex;
+        pages[b_pindex].allocated = false;
+        pages[b_pindex].dirty = true;
+        freelist_push(&pages[b_pindex]);
+    }
+    block->allocated = true;
     page_lock.unlock(irqs);
+
+    // zero without the lock and with interrupts enabled
+    memset(pa2ka<void*>(block->pindex * PAGESIZE), 0, 1UL << block->order);
+
+    irqs = page_lock.lock();
+    block->dirty = false;
+    buddy_free(block->pindex);
+    page_lock.unlock(irqs);
+    return true;
 }
 
 
@@ -289,14 +1151,22 @@ void kfree(void* ptr) {
 static void check_pages_invariants() {
     // pages array invariants
     uintptr_t addr = 0;
-    while (addr < MEMSIZE_PHYSICAL) {
+    while (addr < memsize_physical) {
         auto page = &pages[addr / PAGESIZE];
         assert(page->order >= MIN_ORDER);
         assert(page->order <= MAX_ORDER);
         assert(page->pindex == (int) (addr / PAGESIZE));
         assert(addr % (1 << page->order) == 0); // buddy allocator alignment
+        // free bitmaps agree with allocation state
+        assert(freemap_test(page->order, page->pindex) == !page->allocated);
         addr += (1 << page->order);
     }
+
+    // nonempty-order mask agrees with free lists
+    for (int order = MIN_ORDER; order <= MAX_ORDER; ++order) {
+        bool nonempty = nonempty_orders & (1U << (order - MIN_ORDER));
+        assert(nonempty == !free_blocks(order)->empty());
+    }
 }
 
 // test_kalloc
@@ -333,7 +1203,111 @@ void test_kalloc() {
         assert(pages[pindex].order == order);
         assert(pages[pindex].pindex == pindex);
         kfree(ptr);
-        assert(!pages[pindex].allocated);
+        if (order == MIN_ORDER) {
+            // single pages go back to this CPU's magazine
+            assert(pages[pindex].allocated && pages[pindex].cached);
+        } else {
+            assert(!pages[pindex].allocated);
+        }
+        check_pages_invariants();
+    }
+
+    // magazines refill and drain in batches
+    {
+        x86_64_page* chain = nullptr;
+        for (int i = 0; i != 2 * MAGAZINE_MAX; ++i) {
+            auto pg = kallocpage();
+            assert(pg);
+            int pindex = ka2pa(pg) / PAGESIZE;
+            assert(pages[pindex].allocated && !pages[pindex].cached);
+            *reinterpret_cast<x86_64_page**>(pg) = chain;
+            chain = pg;
+        }
+        while (chain) {
+            auto next = *reinterpret_cast<x86_64_page**>(chain);
+            *reinterpret_cast<x86_64_page**>(chain) = nullptr;
+            kfree(chain);
+            chain = next;
+        }
+        auto irqs = irqstate::get();
+        cli();
+        assert(this_cpu()->npage_magazine_ <= MAGAZINE_MAX);
+        irqs.restore();
+        check_pages_invariants();
+    }
+
+    // freed memory is not cleared, but kalloc_zeroed memory is
+    for (auto order = MIN_ORDER; order <= MIN_ORDER + 2; order++) {
+        auto ptr = reinterpret_cast<uint8_t*>(kalloc(1 << order));
+        assert(ptr);
+        memset(ptr, 0xCC, 1 << order);
+        kfree(ptr);
+        assert(pages[ka2pa(ptr) / PAGESIZE].dirty);
+        ptr = reinterpret_cast<uint8_t*>(kalloc_zeroed(1 << order));
+        assert(ptr);
+        for (int i = 0; i != (1 << order); ++i) {
+            assert(ptr[i] == 0);
+        }
+        kfree(ptr);
+    }
+    while (kalloc_prezero()) {
+    }
+    check_pages_invariants();
+
+    // a 2MiB block can be split and freed a page at a time
+    if (auto ptr = reinterpret_cast<uint8_t*>(kalloc(HUGEPAGESIZE))) {
+        assert(kalloc_size(ptr) == HUGEPAGESIZE);
+        assert(kalloc_size(ptr + PAGESIZE) == 0);
+        kalloc_split(ptr);
+        assert(kalloc_size(ptr) == PAGESIZE);
+        assert(kalloc_size(ptr + HUGEPAGESIZE - PAGESIZE) == PAGESIZE);
+        for (size_t off = 0; off != HUGEPAGESIZE; off += PAGESIZE) {
+            kfree(ptr + off);
+        }
+        check_pages_invariants();
+    }
+
+    // a 2MiB mapping can be split and unmapped a page at a time
+    if (auto hp = kalloc(HUGEPAGESIZE)) {
+        auto pt = kalloc_pagetable();
+        assert(pt);
+        uintptr_t va = 0x40000000;
+        int r = vmiter(pt, va).map_huge(ka2pa(hp));
+        assert(r == 0);
+        r = vmiter(pt, va + PAGESIZE).kfree_range(PAGESIZE);
+        assert(r == 0);
+        assert(kalloc_size(hp) == PAGESIZE);
+        assert(!pages[ka2pa(hp) / PAGESIZE + 1].allocated
+               || pages[ka2pa(hp) / PAGESIZE + 1].cached);
+        assert(vmiter(pt, va).pa() == ka2pa(hp));
+        r = vmiter(pt, va).kfree_range(HUGEPAGESIZE);
+        assert(r == 0);
+        // memory that is not a `kalloc` block cannot be split
+        r = vmiter(pt, va + HUGEPAGESIZE).map_huge(0);
+        assert(r == 0);
+        r = vmiter(pt, va + HUGEPAGESIZE).unmap_range(PAGESIZE);
+        assert(r < 0);
+        r = vmiter(pt, va + HUGEPAGESIZE).map_huge(0, 0);
+        assert(r == 0);
+        for (ptiter it(pt); it.low(); it.next()) {
+            it.kfree_ptp();
+        }
+        kfree(pt);
         check_pages_invariants();
     }
+
+    // shared pages are freed by the last reference
+    {
+        auto pg = kallocpage();
+        assert(pg && !kalloc_shared(pg));
+        kalloc_ref(pg);
+        assert(kalloc_shared(pg));
+        kfree(pg);
+        assert(!kalloc_shared(pg) && pages[ka2pa(pg) / PAGESIZE].allocated);
+        assert(!pages[ka2pa(pg) / PAGESIZE].cached);
+        kfree(pg);
+        check_pages_invariants();
+    }
+
+    test_slab();
 }
@@ -6,7 +6,14 @@ bufcache bufcache::bc;
 
 #define SUPERBLOCK_BN 0
 
+// the buffer cache gives clean, unreferenced blocks back under pressure
+static shrinker bufcache_shrinker = {
+    [] (size_t npages) { return bufcache::get().shrink(npages); }, nullptr
+};
+
 bufcache::bufcache() {
+    register_shrinker(&bufcache_shrinker);
+
     // // put all blocks in lru list at startup
     // for (size_t i = 0; i < ne; ++i) {
     //     e_list_.push_back(&e_[i]);
@@ -46,12 +53,9 @@ int bufcache::get_bufentry_slot(chickadeefs::blocknum_t bn, irqstate& irqs) {
         // search for 0 ref block in lru list
         if (i == ne) {
             for (auto b = e_list_.front(); b; b = e_list_.next(b)) {
-                if (b->ref_ == 0 && !(b->flags_ & bufentry::f_dirty)) {
+                if (evict(b)) {
                     i = (reinterpret_cast<uintptr_t>(b) -
                         reinterpret_cast<uintptr_t>(&e_[0])) / sizeof(bufentry);
-                    e_list_.erase(b);
-                    kfree(b->buf_);
-                    b->clear();
                     break;
                 }
             }
@@ -60,15 +64,10 @@ int bufcache::get_bufentry_slot(chickadeefs::blocknum_t bn, irqstate& irqs) {
         // search for unused prefetches
         if (i == ne) {
             for (auto b = pref_list_.front(); b; b = pref_list_.next(b)) {
-                if (b->prefetched_ && b->fetch_status_ != E_AGAIN &&
-                    !(b->flags_ & bufentry::f_dirty)) {
-                    // log_printf("Evicting block %d from prefetch.\n", b->bn_);
+                if (evict(b)) {
+                    // log_printf("Evicted block from prefetch.\n");
                     i = (reinterpret_cast<uintptr_t>(b) -
                     reinterpret_cast<uintptr_t>(&e_[0])) / sizeof(bufentry);
-                    // log_printf("Evicting bn %d from slot %d\n", b->bn_, i);
-                    pref_list_.erase(b);
-                    kfree(b->buf_);
-                    b->clear();
                     break;
                 }
             }
@@ -132,14 +131,20 @@ bool bufcache::load_disk_block(size_t i, chickadeefs::blocknum_t bn) {
             return false;
         }
     }
+    // `E_AGAIN` now, so `evict` can't mistake the entry for a finished
+    // prefetch before the read is issued
     e_[i].flags_ |= bufentry::f_loading;
+    e_[i].fetch_status_ = E_AGAIN;
     e_[i].lock_.unlock(irqs);
 
     int r = sata_disk->read_nonblocking(e_[i].buf_, chickadeefs::blocksize,
                                         bn * chickadeefs::blocksize,
                                         &e_[i].fetch_status_);
     if (!r) {
+        irqs = e_[i].lock_.lock();
         e_[i].flags_ &= ~bufentry::f_loading;
+        e_[i].fetch_status_ = 0;
+        e_[i].lock_.unlock(irqs);
         return false;
     }
 
@@ -371,6 +376,71 @@ int bufcache::sync(bool drop) {
 }
 
 
+// bufcache::evict(e)
+//    Remove entry `e` from its list, free its buffer, and clear it, if
+//    it is unreferenced, clean, and not loading. A prefetch stays
+//    `f_loading` until someone uses it, so one whose read has finished
+//    counts as loaded. Returns true if it was evicted. Skips entries whose lock is busy, since
+//    `kalloc` may call `shrink` from `load_disk_block` with that entry's
+//    lock held. Requires `lock_`.
+
+bool bufcache::evict(bufentry* e) {
+    if (!e->lock_.trylock_noirq()) {
+        return false;
+    }
+    bool prefetched = e->prefetched_ && e->fetch_status_ != E_AGAIN;
+    bool ok = e->ref_ == 0 && e->write_ref_ == 0
+        && !(e->flags_ & bufentry::f_dirty)
+        && (!(e->flags_ & bufentry::f_loading) || prefetched)
+        && e->fetch_status_ != E_AGAIN;
+    if (ok) {
+        if (e->prefetched_) {
+            pref_list_.erase(e);
+        } else {
+            e_list_.erase(e);
+        }
+        kfree(e->buf_);
+        e->clear();
+    }
+    e->lock_.unlock_noirq();
+    return ok;
+}
+
+
+// bufcache::shrink(npages)
+//    Free the buffers of up to `npages` clean, unreferenced entries,
+//    least recently used first, then unused prefetches. Returns the
+//    number of pages freed. Called by `kalloc` under memory pressure,
+//    so gives up if the cache is locked.
+
+size_t bufcache::shrink(size_t npages) {
+    irqstate irqs;
+    if (!lock_.trylock(irqs)) {
+        return 0;
+    }
+
+    // entries without buffers have no memory to give back
+    size_t n = 0;
+    for (auto b = e_list_.front(); b && n < npages; ) {
+        auto next = e_list_.next(b);
+        if (b->buf_ && evict(b)) {
+            ++n;
+        }
+        b = next;
+    }
+    for (auto b = pref_list_.front(); b && n < npages; ) {
+        auto next = pref_list_.next(b);
+        if (b->buf_ && evict(b)) {
+            ++n;
+        }
+        b = next;
+    }
+
+    lock_.unlock(irqs);
+    return n;
+}
+
+
 // clean_inode_block(buf)
 //    This function is called when loading an inode block into the
 //    buffer cache. It clears values that are only used in memory.
@@ -561,6 +631,14 @@ unsigned char* chkfsstate::get_data_block(inode* ino, size_t off) {
 //    eventually call `put_inode` on the returned inode pointer.
 chickadeefs::inode* chkfsstate::lookup_inode(inode* dirino,
                                              const char* filename) {
+    return get_inode(lookup_inum(dirino, filename));
+}
+
+
+// chkfsstate::lookup_inum(dirino, filename)
+//    Look up `filename` in the directory inode `dirino`, returning the
+//    corresponding inode number (or 0 if not found).
+auto chkfsstate::lookup_inum(inode* dirino, const char* filename) -> inum_t {
     auto& bc = bufcache::get();
     chkfs_fileiter it(dirino);
 
@@ -585,7 +663,7 @@ chickadeefs::inode* chkfsstate::lookup_inode(inode* dirino,
         bc.put_entry(e);
     }
 
-    return get_inode(in);
+    return in;
 }
 
 
@@ -710,6 +788,23 @@ chickadeefs::dirent* chkfsstate::find_empty_direntry(inode* dirino) {
 }
 
 
+// chickadeefs_lookup_file(filename)
+//    Return the inode number of the file named `filename` in the disk's
+//    root directory, or 0 if there is no such file.
+
+chickadeefs::inum_t chickadeefs_lookup_file(const char* filename) {
+    auto& fs = chkfsstate::get();
+
+    auto dirino = fs.get_inode(1);
+    assert(dirino);
+    dirino->lock_read();
+    auto in = fs.lookup_inum(dirino, filename);
+    dirino->unlock_read();
+    fs.put_inode(dirino);
+    return in;
+}
+
+
 // chickadeefs_read_file_data(filename, buf, sz, off)
 //    Read up to `sz` bytes, from the file named `filename` in the
 //    disk's root directory, into `buf`, starting at file offset `off`.
@@ -717,19 +812,21 @@ chickadeefs::dirent* chkfsstate::find_empty_direntry(inode* dirino) {
 
 size_t chickadeefs_read_file_data(const char* filename,
                                   void* buf, size_t sz, size_t off) {
-    auto& bc = bufcache::get();
-    auto& fs = chkfsstate::get();
+    auto in = chickadeefs_lookup_file(filename);
+    return in ? chickadeefs_read_inode_data(in, buf, sz, off) : 0;
+}
 
-    // read directory to find file inode number
-    auto dirino = fs.get_inode(1);
-    assert(dirino);
-    dirino->lock_read();
 
-    auto ino = fs.lookup_inode(dirino, filename);
+// chickadeefs_read_inode_data(inum, buf, sz, off)
+//    Read up to `sz` bytes, from inode number `inum`, into `buf`, starting
+//    at file offset `off`. Returns the number of bytes read.
 
-    dirino->unlock_read();
-    fs.put_inode(dirino);
+size_t chickadeefs_read_inode_data(chickadeefs::inum_t inum,
+                                   void* buf, size_t sz, size_t off) {
+    auto& bc = bufcache::get();
+    auto& fs = chkfsstate::get();
 
+    auto ino = fs.get_inode(inum);
     if (!ino) {
         return 0;
     }
@@ -776,6 +873,55 @@ size_t chickadeefs_read_file_data(const char* filename,
 }
 
 
+// chickadeefs_write_inode_data(inum, buf, sz, off)
+//    Write up to `sz` bytes from `buf` into inode number `inum`, starting
+//    at file offset `off`. Only overwrites existing file data: the file
+//    does not grow. Returns the number of bytes written.
+
+size_t chickadeefs_write_inode_data(chickadeefs::inum_t inum,
+                                    const void* buf, size_t sz, size_t off) {
+    auto& bc = bufcache::get();
+    auto& fs = chkfsstate::get();
+
+    auto ino = fs.get_inode(inum);
+    if (!ino) {
+        return 0;
+    }
+
+    ino->lock_write();
+    chkfs_fileiter it(ino);
+
+    size_t nwritten = 0;
+    while (sz > 0 && off < ino->size) {
+        bufentry* e;
+        if (!(it.find(off).present()
+              && (e = bc.get_disk_entry(it.blocknum())))) {
+            break;
+        }
+        size_t boff = off - ROUNDDOWN(off, fs.blocksize);
+        size_t ncopy = min(min(ino->size - off, fs.blocksize - boff), sz);
+
+        // `get_write` marks the block dirty
+        bc.get_write(e);
+        auto irqs = e->lock_.lock();
+        memcpy(reinterpret_cast<unsigned char*>(e->buf_) + boff,
+               reinterpret_cast<const unsigned char*>(buf) + nwritten,
+               ncopy);
+        e->lock_.unlock(irqs);
+        bc.put_write(e);
+        bc.put_entry(e);
+
+        nwritten += ncopy;
+        off += ncopy;
+        sz -= ncopy;
+    }
+
+    ino->unlock_write();
+    fs.put_inode(ino);
+    return nwritten;
+}
+
+
 // visualize_root()
 //      Prints to log the names and sizes of the files in the root of disk
 void visualize_root() {
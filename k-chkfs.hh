@@ -65,6 +65,8 @@ struct bufcache {
     void put_write(bufentry* e);
 
     int sync(bool drop);
+    size_t shrink(size_t npages);
+    bool evict(bufentry* e);
 
     void visualize();
     void sully(bufentry* e);
@@ -96,6 +98,7 @@ struct chkfsstate {
     unsigned char* get_data_block(inode* ino, size_t off);
 
     inode* lookup_inode(inode* dirino, const char* name);
+    inum_t lookup_inum(inode* dirino, const char* name);
 
     blocknum_t allocate_block();
     ssize_t find_empty_inode();
@@ -140,8 +143,13 @@ inline chkfsstate& chkfsstate::get() {
     return fs;
 }
 
+chickadeefs::inum_t chickadeefs_lookup_file(const char* filename);
 size_t chickadeefs_read_file_data(const char* filename,
                                   void* buf, size_t sz, size_t off);
+size_t chickadeefs_read_inode_data(chickadeefs::inum_t inum,
+                                   void* buf, size_t sz, size_t off);
+size_t chickadeefs_write_inode_data(chickadeefs::inum_t inum,
+                                    const void* buf, size_t sz, size_t off);
 
 void visualize_root();
 
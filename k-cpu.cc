@@ -34,6 +34,17 @@ void cpustate::init() {
     idle_task_ = nullptr;
     nschedule_ = 0;
     spinlock_depth_ = 0;
+    page_magazine_ = nullptr;
+    npage_magazine_ = 0;
+    nproc_pool_ = 0;
+    pcid_ = false;
+    for (unsigned i = 0; i != NPCID; ++i) {
+        pcid_pagetable_[i] = nullptr;
+        pcid_gen_[i] = 0;
+    }
+    pcid_next_ = 0;
+    loaded_pagetable_ = nullptr;
+    tlb_pending_ = false;
 
     canary_ = canary_value;
 
@@ -67,10 +78,12 @@ void annihilate(proc* p) {
     debug_printf("cpustate::annihilate pid %d\n", p->pid_);
 
     for (vmiter vmit(p); vmit.va() < MEMSIZE_VIRTUAL; vmit.next()) {
-        if (vmit.user() && vmit.writable() && vmit.pa() != ktext2pa(console)) {
+        if (vmit.user() && (vmit.writable() || vmit.cow())
+            && vmit.pa() != ktext2pa(console)) {
             debug_printf("%d virtual mem: freeing va %p\n", p->pid_, vmit.va());
 
-            kfree(reinterpret_cast<void*>(pa2ka(vmit.pa())));
+            // frees a whole 2MiB page at once; `next()` then skips it
+            vmit.kfree_page();
         }
     }
 
@@ -85,7 +98,7 @@ void annihilate(proc* p) {
 
     auto pid = p->pid_;
     // debug_printf("\tfreeing process struct pa=%p ka=%p\n", ka2pa(p), p);
-    kfree(p);
+    kfree_proc(p);
 
     // wipe process from ptable array
     auto irqs = ptable_lock.lock();
@@ -162,11 +175,12 @@ void cpustate::schedule(proc* yielding_from) {
             // re-enqueue `p` at end of run queue if runnable
             if (p->state_ == proc::runnable) {
                 enqueue(p);
+            } else {
+                // `p` may exit and its page table be freed; switch to a
+                // safe one. (A runnable `p` will run here again first.)
+                set_pagetable(early_pagetable);
             }
-            
-            // switch to a safe page table
-            lcr3(ktext2pa(early_pagetable));
-        
+
             current_ = yielding_from = nullptr;
         }
 
@@ -188,11 +202,15 @@ void cpustate::schedule(proc* yielding_from) {
 //    Every CPU has an *idle task*, which is a kernel task (i.e., a
 //    `proc` that runs in kernel mode) that just stops the processor
 //    until an interrupt is received. The idle task runs when a CPU
-//    has nothing better to do.
+//    has nothing better to do. Before halting, it pre-zeroes free
+//    memory for `kalloc_zeroed`.
 
 void idle(proc*) {
     while (1) {
-        asm volatile("hlt");
+        // zero free memory while there's nothing better to do
+        if (!kalloc_prezero()) {
+            asm volatile("hlt");
+        }
     }
 }
 
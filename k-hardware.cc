@@ -33,10 +33,21 @@ x86_64_pagetable* kalloc_pagetable() {
 // set_pagetable
 //    Change page directory. lcr3() is the hardware instruction;
 //    set_pagetable() additionally checks that important kernel procedures are
-//    mappable in `pagetable`, and calls panic() if they aren't.
+//    mappable in `pagetable`, and calls panic() if they aren't (in DEBUG
+//    builds).
+//
+//    Loading %cr3 normally flushes the TLB. set_pagetable() skips the load
+//    if `pagetable` is already loaded, and with PCIDs, gives each CPU's
+//    recently used page tables their own tags, so switching back to one
+//    keeps its translations. Both are only safe while no mapping has been
+//    removed or downgraded since the translations were cached: code that
+//    does that must call invalidate_pagetables().
+
+static std::atomic<unsigned long> pagetable_gen(1);
 
 void set_pagetable(x86_64_pagetable* pagetable) {
     assert(pagetable != nullptr);          // must not be NULL
+#if DEBUG
     if (vmiter(pagetable, HIGHMEM_BASE).pa() != 0) {
         log_printf("[%d] set_pagetable BAD PT %p; result=%p\n",
             current()->pid_, pagetable, vmiter(pagetable, HIGHMEM_BASE).pa());
@@ -47,8 +58,50 @@ void set_pagetable(x86_64_pagetable* pagetable) {
     assert(vmiter(pagetable, KTEXT_BASE).pa() == 0);
     assert(vmiter(pagetable, KTEXT_BASE).writable());
     assert(!vmiter(pagetable, KTEXT_BASE).user());
-    auto pa = is_ktext(pagetable) ? ktext2pa(pagetable) : ka2pa(pagetable);
-    lcr3(pa);
+#endif
+    uintptr_t cr3 = is_ktext(pagetable) ? ktext2pa(pagetable)
+        : ka2pa(pagetable);
+
+    // a timer interrupt must not reassign the PCID under us
+    irqstate irqs = irqstate::get();
+    cli();
+    cpustate* c = this_cpu();
+    // record the page table before reading the generation, so that a
+    // shootdown either sees it loaded or bumps the generation first
+    c->loaded_pagetable_ = pagetable;
+    unsigned long gen = pagetable_gen;
+    // without PCIDs, slot 0 remembers the loaded page table
+    unsigned pcid = 0;
+    if (c->pcid_) {
+        while (pcid != NPCID && c->pcid_pagetable_[pcid] != pagetable) {
+            ++pcid;
+        }
+        if (pcid == NPCID) {
+            pcid = c->pcid_next_;
+            c->pcid_next_ = (c->pcid_next_ + 1) % NPCID;
+        }
+    }
+    bool keep = c->pcid_pagetable_[pcid] == pagetable
+        && c->pcid_gen_[pcid] == gen;
+    c->pcid_pagetable_[pcid] = pagetable;
+    c->pcid_gen_[pcid] = gen;
+    cr3 |= pcid;
+
+    if (!keep || (rcr3() & ~CR3_NOFLUSH) != cr3) {
+        lcr3(keep && c->pcid_ ? cr3 | CR3_NOFLUSH : cr3);
+    }
+    irqs.restore();
+}
+
+
+// invalidate_pagetables()
+//    Make every CPU flush its cached translations the next time it loads a
+//    page table. Call after removing or downgrading mappings in a page
+//    table that might be cached, including before freeing a page table.
+//    Doesn't affect translations in use right now; see invlpg().
+
+void invalidate_pagetables() {
+    ++pagetable_gen;
 }
 
 
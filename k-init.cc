@@ -49,6 +49,7 @@ void init_hardware() {
     // initialize kernel allocator
     init_kalloc();
     // test_kalloc();
+    init_reclaim();
 
     // initialize other CPUs
     init_other_processors();
@@ -197,11 +198,53 @@ void init_constructors() {
 }
 
 
-memrangeset<16> physical_ranges(0x100000000UL);
+memrangeset<16> physical_ranges(MEMSIZE_PHYSICAL_LIMIT);
+uintptr_t memsize_physical;
+
+// cmos_read(reg)
+//    Return the value of CMOS register `reg`.
+static uint8_t cmos_read(int reg) {
+    outb(0x70, reg);
+    return inb(0x71);
+}
+
+// init_physical_memory
+//    Mark installed RAM as available in `physical_ranges`. The boot
+//    loader doesn't collect a BIOS memory map, so we use the sizes the
+//    BIOS (or QEMU) leaves in CMOS.
+static void init_physical_memory() {
+    // extended memory from 1 MiB, in KiB (registers 0x30-0x31; caps at
+    // 64 MiB)
+    uintptr_t ext = cmos_read(0x30) | (cmos_read(0x31) << 8);
+    ext <<= 10;
+    // memory from 16 MiB, in 64 KiB units (registers 0x34-0x35)
+    uintptr_t ext16 = cmos_read(0x34) | (cmos_read(0x35) << 8);
+    ext16 <<= 16;
+    // memory from 4 GiB, in 64 KiB units (registers 0x5B-0x5D)
+    uintptr_t high = cmos_read(0x5B) | (cmos_read(0x5C) << 8)
+        | (cmos_read(0x5D) << 16);
+    high <<= 16;
+
+    uintptr_t low_top = ext16 ? 0x1000000 + ext16 : PA_IOLOWEND + ext;
+    if (low_top <= PA_IOLOWEND) {
+        log_printf("cannot detect memory size, assuming %zu MiB\n",
+                   MEMSIZE_PHYSICAL_DEFAULT >> 20);
+        low_top = MEMSIZE_PHYSICAL_DEFAULT;
+    }
+    low_top = min(low_top, PA_IOHIGHMIN);
+
+    // [0, low_top) starts out available; later calls carve out the holes
+    physical_ranges.set(0, low_top, mem_available);
+    memsize_physical = low_top;
+    if (high) {
+        uintptr_t high_top = min(PA_IOHIGHEND + high, MEMSIZE_PHYSICAL_LIMIT);
+        physical_ranges.set(PA_IOHIGHEND, high_top, mem_available);
+        memsize_physical = high_top;
+    }
+}
 
 void init_physical_ranges() {
-    // [0, MEMSIZE_PHYSICAL) starts out available
-    physical_ranges.set(0, MEMSIZE_PHYSICAL, mem_available);
+    init_physical_memory();
     // 0 page is reserved (because nullptr)
     physical_ranges.set(0, PAGESIZE, mem_reserved);
     // I/O memory is reserved (except the console is `mem_console`)
@@ -232,7 +275,8 @@ void init_physical_ranges() {
     init_sanitizers();
 #endif
 
-    // `physical_ranges` is constant after this point.
+    // `physical_ranges` is constant after this point, except that
+    // `init_kalloc` claims memory for page metadata.
 }
 
 
@@ -282,6 +326,26 @@ void cpustate::init_cpu_hardware() {
     cr0 |= CR0_PE | CR0_PG | CR0_WP | CR0_AM | CR0_MP | CR0_NE;
     lcr0(cr0);
 
+    // tag TLB entries with PCIDs if the processor supports them
+    // (%cr3 holds `early_pagetable`, with PCID 0, as PCIDE requires)
+    pcid_ = cpuid(1).ecx & (1U << 17);
+    if (pcid_) {
+        lcr4(rcr4() | CR4_PCIDE);
+    }
+
+
+    // make PAT entries 1 and 5 (selected by PWT alone) write-combining;
+    // nothing is mapped with PWT yet, so no cached data changes type
+    if (cpuid(1).edx & (1U << 16)) {
+        wrmsr(MSR_IA32_PAT, IA32_PAT_WB
+              | (uint64_t(IA32_PAT_WC) << 8)
+              | (uint64_t(IA32_PAT_UCMINUS) << 16)
+              | (uint64_t(IA32_PAT_UC) << 24)
+              | (uint64_t(IA32_PAT_WB) << 32)
+              | (uint64_t(IA32_PAT_WC) << 40)
+              | (uint64_t(IA32_PAT_UCMINUS) << 48)
+              | (uint64_t(IA32_PAT_UC) << 56));
+    }
 
     // set up syscall/sysret
     wrmsr(MSR_IA32_KERNEL_GS_BASE, reinterpret_cast<uint64_t>(this));
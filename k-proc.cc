@@ -15,15 +15,39 @@ spinlock ptable_lock;           // protects ptable, true_ptable, pid_, ppid_,
 
 proc::proc()
     : pid_(0), regs_(nullptr), yields_(nullptr),
-      state_(blank), pagetable_(nullptr), interrupted_(false), exiting_(false),
-      malloc_top_(0x4000000) {
+      state_(blank), pagetable_(nullptr), cpu_(0), true_pid_(0), ppid_(0),
+      exit_status_(0), interrupted_(false), exiting_(false),
+      fdtable_(nullptr), canary_(0) {
 }
 
 
+// proc pools
+//    Each CPU keeps up to `PROC_POOL_MAX` freed `proc` pages, already
+//    reset by the constructor, so thread creation and teardown usually
+//    skip the buddy allocator. The constructor sets every member, so the
+//    rest of the page (the kernel task stack) is never cleared. Pools are
+//    only touched by their own CPU with interrupts disabled.
+#define PROC_POOL_MAX 8
+
+
 // kalloc_proc()
 //    Allocate and return a new `proc`. Calls the constructor.
 
 proc* kalloc_proc() {
+    if (sizeof(proc) <= PAGESIZE) {
+        irqstate irqs = irqstate::get();
+        cli();
+        cpustate* c = this_cpu();
+        proc* p = c->proc_pool_.pop_front();
+        if (p) {
+            --c->nproc_pool_;
+        }
+        irqs.restore();
+        if (p) {
+            return p;
+        }
+    }
+
     void* ptr;
     if (sizeof(proc) <= PAGESIZE) {
         ptr = kallocpage();
@@ -38,6 +62,34 @@ proc* kalloc_proc() {
 }
 
 
+// kfree_proc(p)
+//    Free `p`, which was returned by `kalloc_proc`. Does nothing if
+//    `p == nullptr`.
+
+void kfree_proc(proc* p) {
+    if (!p) {
+        return;
+    }
+    p->~proc();
+    if (sizeof(proc) <= PAGESIZE) {
+        new (p) proc;
+        irqstate irqs = irqstate::get();
+        cli();
+        cpustate* c = this_cpu();
+        bool pooled = c->nproc_pool_ < PROC_POOL_MAX;
+        if (pooled) {
+            c->proc_pool_.push_front(p);
+            ++c->nproc_pool_;
+        }
+        irqs.restore();
+        if (pooled) {
+            return;
+        }
+    }
+    kfree(p);
+}
+
+
 // helper function to print a proc state
 static const char* sstring_null = "NULL";
 static const char* sstring_blank = "BLANK";
@@ -162,7 +214,8 @@ void memfile_loader::put_page(uint8_t* pg) {
 
 ssize_t disk_loader::get_page(uint8_t** pg, size_t off) {
     auto buf = reinterpret_cast<uint8_t*>(kalloc(PAGESIZE));
-    int r = chickadeefs_read_file_data(name_, buf, PAGESIZE, off);
+    int r = text_inum()
+        ? chickadeefs_read_inode_data(inum_, buf, PAGESIZE, off) : 0;
     *pg = buf;
 
     return r;
@@ -172,6 +225,13 @@ void disk_loader::put_page(uint8_t* pg) {
     kfree(pg);
 }
 
+unsigned disk_loader::text_inum() {
+    if (!inum_) {
+        inum_ = chickadeefs_lookup_file(name_);
+    }
+    return inum_;
+}
+
 
 // proc::load(binary_name)
 //    Load the code corresponding to program `binary_name` into this process
@@ -200,6 +260,7 @@ int proc::load(loader& ld) {
     } u;
     size_t len;
     unsigned nph, phoff;
+    uintptr_t brk = 0;
 
     // validate the binary
     uint8_t* headerpg;
@@ -236,10 +297,13 @@ int proc::load(loader& ld) {
             && (r = load_segment(u.ph, ld)) < 0) {
             goto exit;
         }
+        if (u.ph.p_type == ELF_PTYPE_LOAD) {
+            brk = max(brk, uintptr_t(u.ph.p_va + u.ph.p_memsz));
+        }
     }
 
-    // set the entry point from the ELF header
-    r = 0;
+    // the heap starts after the last segment
+    r = vmregion_add_heap(ld.pagetable_, ROUNDUP(brk, PAGESIZE));
 
  exit:
     ld.put_page(headerpg);
@@ -252,7 +316,9 @@ int proc::load(loader& ld) {
 //    Loads pages `[src, src + ph->p_filesz)` to `dst`, then clears
 //    `[ph->p_va + ph->p_filesz, ph->p_va + ph->p_memsz)` to 0.
 //    Calls `kallocpage` to allocate pages and uses `vmiter::map`
-//    to map them in `pagetable_`. Returns 0 on success and an error
+//    to map them in `pagetable_`. Pages past the file data are left as a
+//    demand-zero region, and read-only segments of disk binaries map
+//    shared text pages when touched. Returns 0 on success and an error
 //    code on failure.
 
 int proc::load_segment(const elf_program& ph, loader& ld) {
@@ -265,14 +331,45 @@ int proc::load_segment(const elf_program& ph, loader& ld) {
         return E_NOEXEC;
     }
 
-    // allocate memory
+    // read-only file data is shared with other processes running this
+    // binary, if it lines up with the file's pages
+    if (!(ph.p_flags & ELF_PFLAG_WRITE)
+        && ph.p_filesz == ph.p_memsz
+        && ph.p_filesz != 0
+        && va % PAGESIZE == ph.p_offset % PAGESIZE
+        && ld.text_inum()) {
+        return vmregion_add_file(ld.pagetable_, ROUNDDOWN(va, PAGESIZE),
+                                 ROUNDUP(end_file, PAGESIZE), PTE_P | PTE_U,
+                                 ld.text_inum(),
+                                 ROUNDDOWN(size_t(ph.p_offset), PAGESIZE),
+                                 false);
+    }
+
+    // allocate memory for file data, using 2MiB pages for aligned 2MiB
+    // chunks; the rest is zero-filled on first touch
+    uintptr_t end_alloc = min(ROUNDUP(end_file, PAGESIZE), end_mem);
     for (vmiter it(ld.pagetable_, ROUNDDOWN(va, PAGESIZE));
-         it.va() < end_mem;
-         it += PAGESIZE) {
-        x86_64_page* pg = kallocpage();
+         it.va() < end_alloc; ) {
+        if (it.va() % HUGEPAGESIZE == 0
+            && end_alloc - it.va() >= HUGEPAGESIZE) {
+            void* hp = kalloc_zeroed(HUGEPAGESIZE);
+            if (hp && it.map_huge(ka2pa(hp)) >= 0) {
+                it += HUGEPAGESIZE;
+                continue;
+            }
+            kfree(hp);
+        }
+        x86_64_page* pg = kallocpage_zeroed();
         if (!pg || it.map(ka2pa(pg)) < 0) {
             return E_NOMEM;
         }
+        it += PAGESIZE;
+    }
+    uintptr_t bss = max(ROUNDUP(end_file, PAGESIZE), ROUNDDOWN(va, PAGESIZE));
+    if (bss < end_mem
+        && vmregion_add(ld.pagetable_, bss, ROUNDUP(end_mem, PAGESIZE),
+                        PTE_P | PTE_W | PTE_U) < 0) {
+        return E_NOMEM;
     }
 
     // load binary data into allocated memory
@@ -297,8 +394,8 @@ int proc::load_segment(const elf_program& ph, loader& ld) {
     }
 
     // set initialized memory to zero
-    for (vmiter it(ld.pagetable_, end_file); it.va() < end_mem; it += sz) {
-        sz = min(it.last_va(), end_mem) - it.va();
+    for (vmiter it(ld.pagetable_, end_file); it.va() < end_alloc; it += sz) {
+        sz = min(it.last_va(), end_alloc) - it.va();
         memset(it.ka<uint8_t*>(), 0, sz);
     }
 
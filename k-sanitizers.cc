@@ -350,7 +350,7 @@ void init_sanitizers() {
 
     // reserve enough pagemap space to cover all allocatable
     // physical memory plus all kernel-accessible memory
-    size_t top = MEMSIZE_PHYSICAL;
+    size_t top = memsize_physical;
     for (auto& it : physical_ranges) {
         if (it.type() == mem_kernel || it.type() == mem_available) {
             top = ROUNDUP(it.last(), PAGESIZE);
@@ -366,9 +366,9 @@ void init_sanitizers() {
     // initialize storage
     asan_pagemap_storage = pa2ka<signed char*>(asan_pagemap_pa);
     signed char* s = const_cast<signed char*>(asan_pagemap_storage);
-    memset(s, 0, MEMSIZE_PHYSICAL / PAGESIZE);
-    memset(s + (MEMSIZE_PHYSICAL / PAGESIZE), 255,
-           asan_pagemap_sz - (MEMSIZE_PHYSICAL / PAGESIZE));
+    memset(s, 0, memsize_physical / PAGESIZE);
+    memset(s + (memsize_physical / PAGESIZE), 255,
+           asan_pagemap_sz - (memsize_physical / PAGESIZE));
     for (auto& it : physical_ranges) {
         if (it.type() == mem_kernel || it.type() == mem_available) {
             memset(s + it.first() / PAGESIZE, 0,
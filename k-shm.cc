@@ -0,0 +1,158 @@
+#include "kernel.hh"
+
+// shared memory segments
+//    A segment is a set of zeroed pages that any number of processes can
+//    attach. Attachments are page table regions (k-vmregion.cc) that map
+//    the segment's pages on first touch; each mapping holds a reference to
+//    its page, and each attachment holds a reference to the segment. A
+//    segment is freed when its last attachment goes away, so it must stay
+//    attached somewhere while other processes still need to find it. (A
+//    segment that is never attached stays until it is.)
+
+#define NSHM 32
+#define SHM_MAXPAGES 4096       // 16MiB per segment
+
+struct shmseg {
+    int key_;                   // 0 for a private segment
+    unsigned refs_;             // attachments
+    size_t npages_;
+    x86_64_page** pages_;
+};
+
+// shm_lock protects everything below it
+static spinlock shm_lock;
+static shmseg* shmsegs[NSHM];
+
+
+// shm_free(seg)
+//    Free segment `seg` and its pages. Mappings of the pages have already
+//    dropped their references.
+static void shm_free(shmseg* seg) {
+    for (size_t i = 0; i != seg->npages_; ++i) {
+        kfree(seg->pages_[i]);
+    }
+    kfree(seg->pages_);
+    kdelete(seg);
+}
+
+
+// shm_get(key, sz)
+//    Return the ID of the segment with key `key`, creating it with room for
+//    `sz` bytes if there is none. Key 0 always creates a new segment.
+//    Returns E_INVAL if `sz` is zero or larger than an existing segment,
+//    E_NOSPC if there are too many segments, and E_NOMEM if memory is
+//    short.
+int shm_get(int key, size_t sz) {
+    size_t npages = ROUNDUP(sz, PAGESIZE) / PAGESIZE;
+    if (sz == 0 || npages > SHM_MAXPAGES) {
+        return E_INVAL;
+    }
+
+    auto irqs = shm_lock.lock();
+    for (int id = 0; key != 0 && id != NSHM; ++id) {
+        if (shmsegs[id] && shmsegs[id]->key_ == key) {
+            int r = npages <= shmsegs[id]->npages_ ? id : E_INVAL;
+            shm_lock.unlock(irqs);
+            return r;
+        }
+    }
+    shm_lock.unlock(irqs);
+
+    // allocate outside the lock
+    shmseg* seg = knew<shmseg>();
+    x86_64_page** pages = reinterpret_cast<x86_64_page**>(
+        kalloc(npages * sizeof(x86_64_page*))
+    );
+    if (!seg || !pages) {
+        kdelete(seg);
+        kfree(pages);
+        return E_NOMEM;
+    }
+    seg->key_ = key;
+    seg->refs_ = 0;
+    seg->npages_ = 0;
+    seg->pages_ = pages;
+    while (seg->npages_ != npages
+           && (pages[seg->npages_] = kallocpage_zeroed())) {
+        ++seg->npages_;
+    }
+    if (seg->npages_ != npages) {
+        shm_free(seg);
+        return E_NOMEM;
+    }
+
+    irqs = shm_lock.lock();
+    int id = 0;
+    while (id != NSHM && shmsegs[id]) {
+        ++id;
+    }
+    // another process may have created the same key meanwhile
+    for (int i = 0; key != 0 && i != NSHM; ++i) {
+        if (shmsegs[i] && shmsegs[i]->key_ == key) {
+            id = npages <= shmsegs[i]->npages_ ? i : E_INVAL;
+            shm_lock.unlock(irqs);
+            shm_free(seg);
+            return id;
+        }
+    }
+    if (id == NSHM) {
+        shm_lock.unlock(irqs);
+        shm_free(seg);
+        return E_NOSPC;
+    }
+    shmsegs[id] = seg;
+    shm_lock.unlock(irqs);
+    return id;
+}
+
+
+// shm_attach(id)
+//    Add an attachment to segment `id`. Returns the segment's size in
+//    bytes, or E_INVAL if there is no such segment.
+ssize_t shm_attach(int id) {
+    ssize_t r = E_INVAL;
+    auto irqs = shm_lock.lock();
+    if (id >= 0 && id < NSHM && shmsegs[id]) {
+        ++shmsegs[id]->refs_;
+        r = shmsegs[id]->npages_ * PAGESIZE;
+    }
+    shm_lock.unlock(irqs);
+    return r;
+}
+
+
+// shm_detach(id)
+//    Drop an attachment to segment `id`, freeing the segment when it was
+//    the last one.
+void shm_detach(int id) {
+    auto irqs = shm_lock.lock();
+    shmseg* seg = shmsegs[id];
+    assert(seg && seg->refs_ > 0);
+    if (--seg->refs_ == 0) {
+        shmsegs[id] = nullptr;
+    } else {
+        seg = nullptr;
+    }
+    shm_lock.unlock(irqs);
+    if (seg) {
+        shm_free(seg);
+    }
+}
+
+
+// shm_page(id, i)
+//    Return page `i` of segment `id` with a new reference for the caller,
+//    who must hold an attachment. Returns `nullptr` if `i` is out of
+//    range.
+x86_64_page* shm_page(int id, size_t i) {
+    x86_64_page* pg = nullptr;
+    auto irqs = shm_lock.lock();
+    shmseg* seg = shmsegs[id];
+    assert(seg && seg->refs_ > 0);
+    if (i < seg->npages_) {
+        pg = seg->pages_[i];
+        kalloc_ref(pg);
+    }
+    shm_lock.unlock(irqs);
+    return pg;
+}
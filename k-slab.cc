@@ -0,0 +1,254 @@
+#include "kernel.hh"
+#include "k-list.hh"
+#include "k-lock.hh"
+
+// slab allocator
+//    Small kernel objects (files, vnodes, pipe buffers) are carved out of
+//    single buddy pages, one size class per cache. Every slab page starts
+//    with a `slab` header, so objects are never page-aligned; `kfree` uses
+//    that to send small objects back here.
+
+// number of fully free slabs a cache keeps before returning pages
+#define SLAB_KEEP_EMPTY 2
+
+struct slab_cache;
+
+struct slab {
+    list_links link_;
+    slab_cache* cache_;
+    void* free_;                // singly-linked list of free objects
+    unsigned nfree_;
+} __attribute__((aligned(64)));
+
+struct slab_cache {
+    size_t objsize_;
+    unsigned nobjs_;            // objects per slab
+
+    // lock_ guards everything below it
+    spinlock lock_;
+    list<slab, &slab::link_> partial_;
+    list<slab, &slab::link_> full_;
+    list<slab, &slab::link_> empty_;
+    unsigned nempty_;
+};
+
+static slab_cache slab_caches[NSLABCLASSES];
+
+
+// slab_shrink(npages)
+//    Return cached empty slabs to the buddy allocator. Shrinker callback.
+static size_t slab_shrink(size_t npages) {
+    size_t n = 0;
+    for (int sc = 0; sc < NSLABCLASSES && n < npages; ++sc) {
+        slab_cache* c = &slab_caches[sc];
+        irqstate irqs;
+        if (!c->lock_.trylock(irqs)) {
+            continue;
+        }
+        list<slab, &slab::link_> release;
+        while (n < npages && !c->empty_.empty()) {
+            release.push_back(c->empty_.pop_front());
+            --c->nempty_;
+            ++n;
+        }
+        c->lock_.unlock(irqs);
+        while (slab* s = release.pop_front()) {
+            kfree(s);
+        }
+    }
+    return n;
+}
+
+static shrinker slab_shrinker = { slab_shrink, nullptr };
+
+
+// init_slab
+//    Initialize the slab caches. Called from `init_kalloc`.
+void init_slab() {
+    for (int sc = 0; sc < NSLABCLASSES; ++sc) {
+        slab_cache* c = &slab_caches[sc];
+        c->objsize_ = 1UL << (sc + SLAB_MINORDER);
+        c->nobjs_ = (PAGESIZE - sizeof(slab)) / c->objsize_;
+        c->nempty_ = 0;
+        assert(c->nobjs_ > 0);
+    }
+    register_shrinker(&slab_shrinker);
+}
+
+
+// slab_of(ptr)
+//    Return the slab header for object `ptr`.
+static slab* slab_of(void* ptr) {
+    return reinterpret_cast<slab*>(
+        ROUNDDOWN(reinterpret_cast<uintptr_t>(ptr), PAGESIZE)
+    );
+}
+
+
+// new_slab(c)
+//    Allocate a page from the buddy allocator and format it as a slab
+//    for cache `c`. Returns `nullptr` on failure.
+static slab* new_slab(slab_cache* c) {
+    void* pg = kallocpage();
+    if (!pg) {
+        return nullptr;
+    }
+    slab* s = new (pg) slab;
+    s->cache_ = c;
+    s->free_ = nullptr;
+    s->nfree_ = c->nobjs_;
+    // thread the free list back to front so objects go out in address order
+    uintptr_t base = reinterpret_cast<uintptr_t>(pg) + sizeof(slab);
+    for (unsigned i = c->nobjs_; i != 0; --i) {
+        void** obj = reinterpret_cast<void**>(base + (i - 1) * c->objsize_);
+        *obj = s->free_;
+        s->free_ = obj;
+    }
+    return s;
+}
+
+
+// kalloc_slab(sc)
+//    Allocate a zeroed object from slab size class `sc`. Returns `nullptr`
+//    on failure.
+void* kalloc_slab(int sc) {
+    assert(sc >= 0 && sc < NSLABCLASSES);
+    slab_cache* c = &slab_caches[sc];
+
+    auto irqs = c->lock_.lock();
+    slab* s = c->partial_.front();
+    if (!s && (s = c->empty_.pop_front())) {
+        --c->nempty_;
+        c->partial_.push_front(s);
+    }
+    if (!s) {
+        // don't hold the cache lock across the buddy allocator
+        c->lock_.unlock(irqs);
+        slab* ns = new_slab(c);
+        if (!ns) {
+            return nullptr;
+        }
+        irqs = c->lock_.lock();
+        c->partial_.push_front(ns);
+        s = ns;
+    }
+
+    void** obj = reinterpret_cast<void**>(s->free_);
+    s->free_ = *obj;
+    --s->nfree_;
+    if (s->nfree_ == 0) {
+        c->partial_.erase(s);
+        c->full_.push_back(s);
+    }
+    c->lock_.unlock(irqs);
+
+    memset(obj, 0, c->objsize_);
+    return obj;
+}
+
+
+// kfree_slab(ptr)
+//    Free an object returned by `kalloc_slab`. Called by `kfree` for
+//    pointers that are not page-aligned.
+void kfree_slab(void* ptr) {
+    slab* s = slab_of(ptr);
+    slab_cache* c = s->cache_;
+    assert(c >= &slab_caches[0] && c < &slab_caches[NSLABCLASSES]);
+    assert((reinterpret_cast<uintptr_t>(ptr) - reinterpret_cast<uintptr_t>(s)
+            - sizeof(slab)) % c->objsize_ == 0);
+
+    slab* release = nullptr;
+    auto irqs = c->lock_.lock();
+    assert(s->nfree_ < c->nobjs_);
+    if (s->nfree_ == 0) {
+        c->full_.erase(s);
+        c->partial_.push_back(s);
+    }
+    *reinterpret_cast<void**>(ptr) = s->free_;
+    s->free_ = ptr;
+    ++s->nfree_;
+    if (s->nfree_ == c->nobjs_) {
+        c->partial_.erase(s);
+        if (c->nempty_ < SLAB_KEEP_EMPTY) {
+            c->empty_.push_back(s);
+            ++c->nempty_;
+        } else {
+            release = s;
+        }
+    }
+    c->lock_.unlock(irqs);
+
+    if (release) {
+        kfree(release);
+    }
+}
+
+
+// print_slab_stats
+//    Log object usage for every slab cache.
+void print_slab_stats() {
+    for (int sc = 0; sc < NSLABCLASSES; ++sc) {
+        slab_cache* c = &slab_caches[sc];
+        size_t nslabs = 0, nused = 0;
+        auto irqs = c->lock_.lock();
+        for (slab* s = c->partial_.front(); s; s = c->partial_.next(s)) {
+            ++nslabs;
+            nused += c->nobjs_ - s->nfree_;
+        }
+        for (slab* s = c->full_.front(); s; s = c->full_.next(s)) {
+            ++nslabs;
+            nused += c->nobjs_;
+        }
+        nslabs += c->nempty_;
+        c->lock_.unlock(irqs);
+        log_printf("\tslab-%zu: %zu slabs, %zu/%zu objects in use\n",
+                   c->objsize_, nslabs, nused, nslabs * c->nobjs_);
+    }
+}
+
+
+// test_slab
+//    Run unit tests on the slab caches. Called from `test_kalloc`.
+void test_slab() {
+    static_assert(slab_class(1, 1) == 0, "smallest class");
+    static_assert(slab_class(1U << SLAB_MINORDER, 8) == 0, "exact fit");
+    static_assert(slab_class((1U << SLAB_MINORDER) + 1, 8) == 1, "round up");
+    static_assert(slab_class(1U << SLAB_MAXORDER, 8) == NSLABCLASSES - 1,
+                  "largest class");
+    static_assert(slab_class((1U << SLAB_MAXORDER) + 1, 8) == -1, "too big");
+    static_assert(slab_class(8, 4096) == -1, "overaligned");
+
+    for (int sc = 0; sc < NSLABCLASSES; ++sc) {
+        slab_cache* c = &slab_caches[sc];
+        // fill more than one slab, chaining objects through their first
+        // word, then free everything
+        void* first = nullptr;
+        void* last = nullptr;
+        for (unsigned i = 0; i != c->nobjs_ + 1; ++i) {
+            void* obj = kalloc_slab(sc);
+            assert(obj);
+            assert(reinterpret_cast<uintptr_t>(obj) % PAGESIZE != 0);
+            assert(reinterpret_cast<uintptr_t>(obj) % 16 == 0);
+            assert(slab_of(obj)->cache_ == c);
+            for (size_t j = 0; j != c->objsize_; ++j) {
+                assert(reinterpret_cast<uint8_t*>(obj)[j] == 0);
+            }
+            memset(obj, 0xCC, c->objsize_);
+            *reinterpret_cast<void**>(obj) = first;
+            first = obj;
+            last = last ? last : obj;
+        }
+        assert(slab_of(first) != slab_of(last));
+        while (first) {
+            void* next = *reinterpret_cast<void**>(first);
+            kfree(first);
+            first = next;
+        }
+    }
+
+    // knew/kdelete pick a slab for small types
+    struct small_object { int x[10]; };
+    auto so = knew<small_object>();
+    assert(so && reinterpret_cast<uintptr_t>(so) % PAGESIZE != 0);
+    kdelete(so);
+}
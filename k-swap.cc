@@ -0,0 +1,269 @@
+#include "kernel.hh"
+#include "k-vmiter.hh"
+#include "k-chkfs.hh"
+#include "k-devices.hh"
+
+// swap space
+//    Anonymous user pages can be evicted to the swap area that
+//    `mkchickadeefs -w` reserves after the superblock. The area is
+//    divided into page-sized slots. An evicted page's PTE becomes a
+//    non-present swap entry (`PTE_SWAP`) that records the slot and the
+//    page's permissions, and the page is read back into a fresh page on
+//    the next fault. Each swap entry holds a reference to its slot, since
+//    `fork` copies swap entries; a slot is free when its count is 0.
+//
+//    The background reclaim task chooses victims (`vmregion_swap_out`)
+//    and calls `swap_out_page`. Pages are written out while mapped
+//    read-only copy-on-write, so a write during the disk write just
+//    restores the page (`break_cow`) and cancels its eviction.
+//
+//    Reading a page back blocks, and the kernel touches user memory with
+//    spinlocks held (e.g., copying pipe data). So a page table is pinned
+//    while any of its threads is in a system call (`swap_pin`): its pages
+//    are not evicted, and the pages the call checks with
+//    `validate_memory` are read back before it takes any lock.
+
+// page tables with threads in system calls, and how many; protected by
+// `cow_lock`, which also covers the mappings eviction changes
+struct swap_pin_entry {
+    x86_64_pagetable* pt_;
+    unsigned n_;
+};
+static swap_pin_entry swap_pins[NPROC];
+
+// swap_lock protects everything below it
+static spinlock swap_lock;
+static uint16_t* swap_refs;     // per-slot reference counts
+static size_t swap_nslots;      // 0 if there is no swap area
+static size_t swap_off;         // disk offset of slot 0
+static size_t swap_hint;        // where the next free-slot search starts
+static bool swap_inited;
+
+
+// swap_init()
+//    Find the swap area, if any. Returns true if swapping is possible.
+//    Reads the superblock, so may block.
+bool swap_init() {
+    if (swap_inited || !sata_disk) {
+        return swap_nslots != 0;
+    }
+
+    auto& bc = bufcache::get();
+    unsigned char* superblock_data = reinterpret_cast<unsigned char*>
+        (bc.get_disk_block(0));
+    if (!superblock_data) {
+        return false;
+    }
+    auto sb = reinterpret_cast<chickadeefs::superblock*>
+        (&superblock_data[chickadeefs::superblock_offset]);
+    size_t nslots = sb->nswap * chickadeefs::blocksize / PAGESIZE;
+    size_t off = sb->swap_bn * chickadeefs::blocksize;
+    bc.put_block(superblock_data);
+
+    uint16_t* refs = nullptr;
+    if (nslots) {
+        refs = reinterpret_cast<uint16_t*>(
+            kalloc_zeroed(ROUNDUP(nslots * sizeof(uint16_t), PAGESIZE))
+        );
+        if (!refs) {
+            return false;
+        }
+    }
+
+    auto irqs = swap_lock.lock();
+    if (!swap_inited) {
+        swap_refs = refs;
+        swap_nslots = refs ? nslots : 0;
+        swap_off = off;
+        swap_inited = true;
+        refs = nullptr;
+    }
+    swap_lock.unlock(irqs);
+    kfree(refs);
+    return swap_nslots != 0;
+}
+
+
+// swap_alloc()
+//    Return a free swap slot, now with one reference, or E_NOSPC.
+intptr_t swap_alloc() {
+    auto irqs = swap_lock.lock();
+    for (size_t n = 0; n != swap_nslots; ++n) {
+        size_t slot = (swap_hint + n) % swap_nslots;
+        if (swap_refs[slot] == 0) {
+            swap_refs[slot] = 1;
+            swap_hint = slot + 1;
+            swap_lock.unlock(irqs);
+            return slot;
+        }
+    }
+    swap_lock.unlock(irqs);
+    return E_NOSPC;
+}
+
+
+// swap_ref(slot), swap_free(slot)
+//    Add or drop a reference to swap slot `slot`. The slot is free for
+//    reuse once its last reference is dropped.
+void swap_ref(size_t slot) {
+    auto irqs = swap_lock.lock();
+    assert(slot < swap_nslots && swap_refs[slot] != 0
+           && swap_refs[slot] != uint16_t(-1));
+    ++swap_refs[slot];
+    swap_lock.unlock(irqs);
+}
+
+void swap_free(size_t slot) {
+    auto irqs = swap_lock.lock();
+    assert(slot < swap_nslots && swap_refs[slot] != 0);
+    --swap_refs[slot];
+    swap_lock.unlock(irqs);
+}
+
+
+// swap_pin(pt), swap_unpin(pt)
+//    Keep `pt`'s pages resident until the matching `swap_unpin`. Each
+//    thread holds at most one pin, for the system call it is in.
+void swap_pin(x86_64_pagetable* pt) {
+    auto irqs = cow_lock.lock();
+    swap_pin_entry* free = nullptr;
+    for (auto& e : swap_pins) {
+        if (e.pt_ == pt) {
+            ++e.n_;
+            cow_lock.unlock(irqs);
+            return;
+        } else if (!e.pt_ && !free) {
+            free = &e;
+        }
+    }
+    assert(free);
+    free->pt_ = pt;
+    free->n_ = 1;
+    cow_lock.unlock(irqs);
+}
+
+void swap_unpin(x86_64_pagetable* pt) {
+    auto irqs = cow_lock.lock();
+    for (auto& e : swap_pins) {
+        if (e.pt_ == pt) {
+            if (--e.n_ == 0) {
+                e.pt_ = nullptr;
+            }
+            break;
+        }
+    }
+    cow_lock.unlock(irqs);
+}
+
+// swap_pinned(pt)
+//    Return true if `pt` is pinned. Requires `cow_lock`.
+static bool swap_pinned(x86_64_pagetable* pt) {
+    for (auto& e : swap_pins) {
+        if (e.pt_ == pt) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// swap_out_page(pt, va)
+//    Evict the page mapped at `va` in `pt` to a new swap slot. The page
+//    must be an unshared, writable single page in an anonymous region.
+//    `pt` must stay alive (see `vmregion_swap_out`). Returns 1 if the page
+//    was freed, 0 if it couldn't be evicted right now (for instance
+//    because it was written meanwhile or `pt` is pinned), and an error code if swap is full
+//    or the disk failed. Blocks.
+int swap_out_page(x86_64_pagetable* pt, uintptr_t va) {
+    intptr_t slot = swap_alloc();
+    if (slot < 0) {
+        return slot;
+    }
+
+    // make the page read-only copy-on-write on every CPU
+    tlbgather tlb(pt);
+    auto irqs = cow_lock.lock();
+    vmiter it(pt, va);
+    void* ka = nullptr;
+    uintptr_t pa = 0;
+    int perm = 0;
+    if (!swap_pinned(pt)
+        && it.present() && !it.huge() && it.user() && it.writable()
+        && !it.cow() && !it.shared()
+        && kalloc_size(it.ka<void*>()) == PAGESIZE
+        && !kalloc_shared(it.ka<void*>())) {
+        ka = it.ka<void*>();
+        pa = it.pa();
+        perm = it.perm() & (PTE_P | PTE_W | PTE_U);
+        int r = it.map(pa, (perm & ~PTE_W) | PTE_COW);
+        assert(r == 0);
+        tlb.add(va, PAGESIZE);
+    }
+    cow_lock.unlock(irqs);
+    tlb.flush();
+    if (!ka) {
+        swap_free(slot);
+        return 0;
+    }
+
+    volatile int status;
+    int r = sata_disk->write(ka, PAGESIZE, swap_off + slot * PAGESIZE,
+                             &status);
+
+    // replace the mapping with the swap entry if the page is unchanged
+    irqs = cow_lock.lock();
+    it.find(va);
+    bool evict = r == 0 && !swap_pinned(pt)
+        && it.present() && it.pa() == pa && it.cow() && !kalloc_shared(ka);
+    if (evict) {
+        r = it.map(slot << PAGEOFFBITS, PTE_SWAP | (perm & ~PTE_P));
+        assert(r == 0);
+        tlb.free(ka);
+        tlb.add(va, PAGESIZE);
+    }
+    cow_lock.unlock(irqs);
+    tlb.flush();
+    if (!evict) {
+        swap_free(slot);
+    }
+    return r < 0 ? E_IO : evict;
+}
+
+
+// swap_in(pt, va)
+//    Read the page at `va`, which has a swap entry in `pt`, back from
+//    swap. Returns true if the page is now mapped (perhaps by another
+//    thread). Blocks.
+bool swap_in(x86_64_pagetable* pt, uintptr_t va) {
+    va = ROUNDDOWN(va, PAGESIZE);
+    vmiter it(pt, va);
+    if (!it.swapped()) {
+        return it.present();
+    }
+    size_t slot = it.swap_slot();
+    x86_64_page* pg = kallocpage();
+    if (!pg) {
+        return false;
+    }
+    volatile int status;
+    if (sata_disk->read(pg, PAGESIZE, swap_off + slot * PAGESIZE,
+                        &status) < 0) {
+        kfree(pg);
+        return false;
+    }
+
+    // another thread may have swapped it in or unmapped it
+    auto irqs = cow_lock.lock();
+    it.find(va);
+    bool ok = it.present();
+    if (it.swapped() && it.swap_slot() == slot) {
+        ok = it.map(ka2pa(pg), PTE_P | it.swap_perm()) >= 0;
+        if (ok) {
+            pg = nullptr;
+            swap_free(slot);
+        }
+    }
+    cow_lock.unlock(irqs);
+    kfree(pg);
+    return ok;
+}
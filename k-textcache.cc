@@ -0,0 +1,148 @@
+#include "kernel.hh"
+#include "k-chkfs.hh"
+
+// shared text pages
+//    Read-only segments of programs on disk, and `mmap`ed files, are mapped
+//    straight from a cache of pages keyed by (inode number, file offset),
+//    so processes running the same program share one copy of its text and
+//    mapping a file doesn't copy it per process. The cache holds one
+//    reference to each page and every mapping holds another (`kalloc_ref`).
+//    Pages stay cached after their last user exits, ready for the next
+//    `exec`, until the shrinker reclaims them or the file is written.
+
+struct textpage {
+    list_links link_;
+    unsigned inum_;
+    size_t off_;
+    x86_64_page* pg_;
+};
+
+// textcache_lock protects everything below it
+static spinlock textcache_lock;
+static list<textpage, &textpage::link_> textpages;  // most recent first
+static unsigned textcache_gen;      // incremented by `textcache_invalidate`
+static bool textcache_registered;
+
+
+// textcache_find(inum, off)
+//    Return the cached page at offset `off` of inode `inum`, or `nullptr`.
+//    Moves it to the front of the list. Requires `textcache_lock`.
+static textpage* textcache_find(unsigned inum, size_t off) {
+    for (textpage* tp = textpages.front(); tp; tp = textpages.next(tp)) {
+        if (tp->inum_ == inum && tp->off_ == off) {
+            textpages.erase(tp);
+            textpages.push_front(tp);
+            return tp;
+        }
+    }
+    return nullptr;
+}
+
+
+// textcache_shrink(npages)
+//    Free cached text pages that no process maps, least recently used
+//    first. Shrinker callback.
+static size_t textcache_shrink(size_t npages) {
+    list<textpage, &textpage::link_> dead;
+    size_t n = 0;
+    irqstate irqs;
+    if (!textcache_lock.trylock(irqs)) {
+        return 0;
+    }
+    textpage* prev;
+    for (textpage* tp = textpages.back(); tp && n < npages; tp = prev) {
+        prev = textpages.prev(tp);
+        if (!kalloc_shared(tp->pg_)) {
+            textpages.erase(tp);
+            dead.push_back(tp);
+            ++n;
+        }
+    }
+    textcache_lock.unlock(irqs);
+
+    while (textpage* tp = dead.pop_front()) {
+        kfree(tp->pg_);
+        kdelete(tp);
+    }
+    return n;
+}
+
+static shrinker textcache_shrinker = { textcache_shrink, nullptr };
+
+
+// textcache_get(inum, off)
+//    Return the page at page-aligned offset `off` of inode `inum`, reading
+//    it from disk if it is not cached. The caller owns one reference to
+//    the page and drops it with `kfree`. Returns `nullptr` if the page
+//    can't be read or memory is short. May block.
+x86_64_page* textcache_get(unsigned inum, size_t off) {
+    assert(off % PAGESIZE == 0);
+    auto irqs = textcache_lock.lock();
+    if (textpage* tp = textcache_find(inum, off)) {
+        kalloc_ref(tp->pg_);
+        textcache_lock.unlock(irqs);
+        return tp->pg_;
+    }
+    unsigned gen = textcache_gen;
+    textcache_lock.unlock(irqs);
+
+    x86_64_page* pg = kallocpage_zeroed();
+    textpage* ntp = knew<textpage>();
+    if (!pg || !ntp
+        || chickadeefs_read_inode_data(inum, pg, PAGESIZE, off) == 0) {
+        kfree(pg);
+        kdelete(ntp);
+        return nullptr;
+    }
+
+    irqs = textcache_lock.lock();
+    if (textpage* tp = textcache_find(inum, off)) {
+        // another process read it first
+        kalloc_ref(tp->pg_);
+        x86_64_page* cached = tp->pg_;
+        textcache_lock.unlock(irqs);
+        kfree(pg);
+        kdelete(ntp);
+        return cached;
+    }
+    if (gen == textcache_gen) {
+        // don't cache data that may predate a write to the file
+        ntp->inum_ = inum;
+        ntp->off_ = off;
+        ntp->pg_ = pg;
+        textpages.push_front(ntp);
+        kalloc_ref(pg);
+        ntp = nullptr;
+        if (!textcache_registered) {
+            register_shrinker(&textcache_shrinker);
+            textcache_registered = true;
+        }
+    }
+    textcache_lock.unlock(irqs);
+    kdelete(ntp);
+    return pg;
+}
+
+
+// textcache_invalidate(inum)
+//    Drop every cached page of inode `inum`. Called when the file changes.
+//    Processes that map those pages keep them until they exit.
+void textcache_invalidate(unsigned inum) {
+    list<textpage, &textpage::link_> dead;
+    auto irqs = textcache_lock.lock();
+    textpage* next;
+    for (textpage* tp = textpages.front(); tp; tp = next) {
+        next = textpages.next(tp);
+        if (tp->inum_ == inum) {
+            textpages.erase(tp);
+            dead.push_back(tp);
+        }
+    }
+    ++textcache_gen;
+    textcache_lock.unlock(irqs);
+
+    while (textpage* tp = dead.pop_front()) {
+        kfree(tp->pg_);
+        kdelete(tp);
+    }
+}
@@ -0,0 +1,161 @@
+#include "kernel.hh"
+#include "k-apic.hh"
+#include "k-vmiter.hh"
+
+// TLB shootdowns
+//    Threads share a page table but may run on different CPUs, so changing
+//    a mapping must invalidate it on every CPU that has the page table
+//    loaded, not just this one. `set_pagetable` records each CPU's loaded
+//    page table in `loaded_pagetable_`; CPUs that cached translations for
+//    a page table they no longer run are handled by
+//    `invalidate_pagetables`. A shootdown sends one IPI to each CPU running
+//    the page table and waits until all of them have invalidated the
+//    range.
+
+// tlb_lock serializes shootdowns and protects the `tlb_` members of
+// every cpustate
+static spinlock tlb_lock;
+
+
+// tlb_invalidate(pt, start, end)
+//    Invalidate this CPU's translations for [start, end) if `pt` is
+//    loaded. Large ranges flush the whole TLB. Requires disabled
+//    interrupts.
+static void tlb_invalidate(x86_64_pagetable* pt, uintptr_t start,
+                           uintptr_t end) {
+    if (this_cpu()->loaded_pagetable_ != pt) {
+        return;
+    }
+    if (end - start > TLB_FLUSH_THRESHOLD * PAGESIZE) {
+        // loading %cr3 without the no-flush bit flushes its PCID
+        lcr3(rcr3() & ~CR3_NOFLUSH);
+    } else {
+        for (uintptr_t va = start; va < end; va += PAGESIZE) {
+            invlpg(reinterpret_cast<void*>(va));
+        }
+    }
+}
+
+
+// tlb_shootdown_handle()
+//    Handle this CPU's pending shootdown request, if any. Called for the
+//    shootdown IPI, and by CPUs waiting for `tlb_lock`, so two CPUs
+//    shooting down at once can't wait for each other forever.
+void tlb_shootdown_handle() {
+    cpustate* c = this_cpu();
+    if (c->tlb_pending_) {
+        tlb_invalidate(c->tlb_pt_, c->tlb_start_, c->tlb_end_);
+        c->tlb_pending_ = false;
+    }
+}
+
+
+// tlb_shootdown(pt, start, end)
+//    Invalidate translations for [start, end) in page table `pt` on every
+//    CPU.
+static void tlb_shootdown(x86_64_pagetable* pt, uintptr_t start,
+                          uintptr_t end) {
+    // CPUs that load `pt` from now on won't reuse old translations
+    invalidate_pagetables();
+
+    irqstate irqs = irqstate::get();
+    cli();
+    while (!tlb_lock.trylock_noirq()) {
+        tlb_shootdown_handle();
+        pause();
+    }
+
+    cpustate* self = this_cpu();
+    tlb_invalidate(pt, start, end);
+
+    auto& lapic = lapicstate::get();
+    for (int i = 0; i != ncpu; ++i) {
+        cpustate* c = &cpus[i];
+        if (c != self && c->loaded_pagetable_ == pt) {
+            c->tlb_pt_ = pt;
+            c->tlb_start_ = start;
+            c->tlb_end_ = end;
+            c->tlb_pending_ = true;
+            while (lapic.ipi_pending()) {
+                pause();
+            }
+            lapic.ipi(c->lapic_id_, lapic.ipi_fixed,
+                      INT_IRQ + IRQ_SHOOTDOWN);
+        }
+    }
+    for (int i = 0; i != ncpu; ++i) {
+        while (cpus[i].tlb_pending_) {
+            pause();
+        }
+    }
+
+    tlb_lock.unlock_noirq();
+    irqs.restore();
+}
+
+
+// tlbgather::tlbgather(pt), tlbgather::~tlbgather()
+
+tlbgather::tlbgather(x86_64_pagetable* pt)
+    : pt_(pt), start_(VA_LOWEND), end_(0), npages_(0) {
+}
+
+tlbgather::~tlbgather() {
+    flush();
+}
+
+
+// tlbgather::add(va, sz)
+//    Note that mappings in [va, va + sz) changed. The batch invalidates
+//    one range covering everything added.
+
+void tlbgather::add(uintptr_t va, size_t sz) {
+    start_ = min(start_, ROUNDDOWN(va, PAGESIZE));
+    end_ = max(end_, ROUNDUP(va + sz, PAGESIZE));
+}
+
+
+// tlbgather::free(ka)
+//    Free page `ka` (drop a reference to it) after the next flush.
+
+void tlbgather::free(void* ka) {
+    if (npages_ == TLBGATHER_NPAGES) {
+        flush();
+    }
+    pages_[npages_] = ka;
+    ++npages_;
+}
+
+
+// tlbgather::free_page(it)
+//    Clear `it`'s mapping and free the page it mapped after the next
+//    flush. For a 2MiB page, `it.va()` must be its first address.
+
+void tlbgather::free_page(vmiter& it) {
+    bool huge = it.huge();
+    assert((it.va() & (huge ? HUGEPAGESIZE - 1 : PAGESIZE - 1)) == 0);
+    if (it.present()) {
+        // (`free` may flush, so add the range afterwards)
+        free(it.ka<void*>());
+        int r = huge ? it.map_huge(0, 0) : it.map(0, 0);
+        assert(r == 0);
+        add(it.va(), huge ? HUGEPAGESIZE : PAGESIZE);
+    }
+}
+
+
+// tlbgather::flush()
+//    Invalidate the changed range on every CPU, then free the gathered
+//    pages.
+
+void tlbgather::flush() {
+    if (start_ < end_) {
+        tlb_shootdown(pt_, start_, end_);
+    }
+    for (unsigned i = 0; i != npages_; ++i) {
+        kfree(pages_[i]);
+    }
+    start_ = VA_LOWEND;
+    end_ = 0;
+    npages_ = 0;
+}
@@ -366,6 +366,10 @@ size_t vnode_inode::write(uintptr_t buf, size_t sz, size_t& off) {
             i_->size = off;
         }
     }
+    // running programs keep their text; later execs reread it
+    if (nwritten) {
+        textcache_invalidate(inum_);
+    }
     i_->unlock_write();
     return nwritten;
 }
@@ -47,6 +47,10 @@ struct vnode {
     virtual size_t size() {
         return E_PERM;
     }
+    // disk inode holding this file's data, or 0 (for `mmap`)
+    virtual unsigned inum() {
+        return 0;
+    }
 
     vnode() : bb_(nullptr), refs_(1) { };
     ~vnode();
@@ -117,15 +121,20 @@ struct vnode_memfile : vnode {
 
 
 struct vnode_inode : vnode {
-    vnode_inode(chickadeefs::inode* i) : i_(i) { };
+    vnode_inode(chickadeefs::inode* i, chickadeefs::inum_t inum)
+        : i_(i), inum_(inum) { };
     ~vnode_inode();
 
     size_t read(uintptr_t buf, size_t sz, size_t& off) override;
     size_t write(uintptr_t buf, size_t sz, size_t& off) override;
     size_t size() override;
+    unsigned inum() override {
+        return inum_;
+    }
 
   private:
     chickadeefs::inode* i_;
+    chickadeefs::inum_t inum_;
 };
 
 
@@ -31,7 +31,7 @@ void vmiter::next() {
     real_find((va_ | pageoffmask(level)) + 1);
 }
 
-int vmiter::map(uintptr_t pa, int perm) {
+int vmiter::map(uintptr_t pa, uint64_t perm) {
     assert(!(va_ & PAGEOFFMASK));
     if (perm & PTE_P) {
         assert((pa & PTE_PAMASK) == pa);
@@ -40,14 +40,17 @@ int vmiter::map(uintptr_t pa, int perm) {
     }
     assert(!(perm & ~perm_ & (PTE_P | PTE_W | PTE_U)));
 
+    if (huge() && split() < 0) {
+        return -1;
+    }
+
     while (level_ > 0 && perm) {
         assert(!(*pep_ & PTE_P));
         x86_64_pagetable* pt = reinterpret_cast<x86_64_pagetable*>
-            (kallocpage());
+            (kallocpage_zeroed());
         if (!pt) {
             return -1;
         }
-        memset(pt, 0, PAGESIZE);
         *pep_ = ka2pa(pt) | PTE_P | PTE_W | PTE_U;
         down();
     }
@@ -58,10 +61,155 @@ int vmiter::map(uintptr_t pa, int perm) {
     return 0;
 }
 
+int vmiter::map_huge(uintptr_t pa, uint64_t perm) {
+    assert(!(va_ & (HUGEPAGESIZE - 1)));
+    assert(!(pa & (HUGEPAGESIZE - 1)) && (pa & PTE_PS_PAMASK) == pa);
+    if (!(perm & PTE_P)) {
+        assert(!pa);
+        if (huge()) {
+            *pep_ = 0;
+        }
+        return 0;
+    }
+    assert(!(perm & ~perm_ & (PTE_P | PTE_W | PTE_U)));
+
+    while (level_ > 1) {
+        assert(!(*pep_ & PTE_P));
+        x86_64_pagetable* pt = reinterpret_cast<x86_64_pagetable*>
+            (kallocpage_zeroed());
+        if (!pt) {
+            return -1;
+        }
+        *pep_ = ka2pa(pt) | PTE_P | PTE_W | PTE_U;
+        down();
+    }
+
+    if (level_ != 1 || (*pep_ & PTE_P)) {
+        // region already has a page table page or a mapping
+        return -1;
+    }
+    *pep_ = pa | perm | PTE_PS;
+    return 0;
+}
+
+int vmiter::map_range(uintptr_t pa, size_t sz, uint64_t perm, bool huge) {
+    assert(!(va_ & PAGEOFFMASK) && !(pa & PAGEOFFMASK)
+           && !(sz & PAGEOFFMASK));
+    assert(perm & PTE_P);
+    uintptr_t end = va_ + sz;
+    while (va_ < end) {
+        if (huge && !(va_ & (HUGEPAGESIZE - 1))
+            && !(pa & (HUGEPAGESIZE - 1))
+            && end - va_ >= HUGEPAGESIZE
+            && map_huge(pa, perm) >= 0) {
+            pa += HUGEPAGESIZE;
+            real_find(va_ + HUGEPAGESIZE);
+            continue;
+        }
+        // `map` allocates missing page table pages; the rest of this
+        // level-1 page table page is filled directly
+        if (map(pa, perm) < 0) {
+            return -1;
+        }
+        uintptr_t va = va_ + PAGESIZE;
+        pa += PAGESIZE;
+        x86_64_pageentry_t* pep = pep_ + 1;
+        while (va < end && pageindex(va, 0) != 0) {
+            *pep = pa | perm;
+            ++pep;
+            va += PAGESIZE;
+            pa += PAGESIZE;
+        }
+        real_find(va);
+    }
+    return 0;
+}
+
+int vmiter::unmap_range(size_t sz) {
+    return clear_range(sz, false);
+}
+
+int vmiter::kfree_range(size_t sz) {
+    return clear_range(sz, true);
+}
+
+int vmiter::clear_range(size_t sz, bool free) {
+    assert(!(va_ & PAGEOFFMASK) && !(sz & PAGEOFFMASK));
+    uintptr_t end = va_ + sz;
+    while (va_ < end) {
+        if (level_ > 0 && !(*pep_ & PTE_P)) {
+            // nothing mapped below this entry
+            real_find(min(last_va(), end));
+            continue;
+        }
+        if (huge()) {
+            if (!(va_ & (HUGEPAGESIZE - 1)) && end - va_ >= HUGEPAGESIZE) {
+                if (free) {
+                    kfree(ka<void*>());
+                }
+                *pep_ = 0;
+                real_find(va_ + HUGEPAGESIZE);
+                continue;
+            }
+            if (split() < 0) {
+                return -1;
+            }
+        }
+        assert(level_ == 0);
+        // clear to the end of this level-1 page table page
+        uintptr_t va = va_;
+        x86_64_pageentry_t* pep = pep_;
+        do {
+            if (free && (*pep & PTE_P)) {
+                kfree(pa2ka<void*>(*pep & PTE_PAMASK));
+            } else if (free && (*pep & PTE_SWAP)) {
+                swap_free(*pep >> PAGEOFFBITS);
+            }
+            *pep = 0;
+            ++pep;
+            va += PAGESIZE;
+        } while (va < end && pageindex(va, 0) != 0);
+        real_find(va);
+    }
+    return 0;
+}
+
+int vmiter::split() {
+    if (!huge()) {
+        return 0;
+    }
+    // the pages must be freeable one at a time afterwards
+    uintptr_t pa = *pep_ & PTE_PS_PAMASK;
+    void* ka = pa2ka<void*>(pa);
+    if (kalloc_size(ka) != HUGEPAGESIZE || kalloc_shared(ka)) {
+        return -1;
+    }
+    x86_64_pagetable* pt = reinterpret_cast<x86_64_pagetable*>
+        (kallocpage());
+    if (!pt) {
+        return -1;
+    }
+    kalloc_split(ka);
+    // PS entries keep PAT in bit 12; 4KiB entries keep it in bit 7
+    uint64_t flags = *pep_ & ~(PTE_PAMASK | PTE_PS);
+    if (*pep_ & 0x1000) {
+        flags |= PTE_PS;
+    }
+    for (int i = 0; i != (1 << PAGEINDEXBITS); ++i) {
+        pt->entry[i] = (pa + i * PAGESIZE) | flags;
+    }
+    *pep_ = ka2pa(pt) | PTE_P | PTE_W | PTE_U;
+    // the old 2MiB translation may be cached
+    invlpg(reinterpret_cast<void*>(va_ & ~(HUGEPAGESIZE - 1)));
+    down();
+    return 0;
+}
+
 bool vmiter::check_range(size_t sz, uint64_t perms) {
     uintptr_t start = va();
     while (va() < start + sz) {
-        if (!perm(perms))
+        // copy-on-write pages become writable when written
+        if (!perm(perms) && !(cow() && perm(perms & ~PTE_W)))
             return false;
         step();
     }
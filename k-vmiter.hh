@@ -22,10 +22,21 @@ class vmiter {
     template <typename T = void*>
     inline T ka() const;              // kernel version of pa()
     inline uint64_t perm() const;     // current permissions
+    inline uint64_t page_perm() const; // perm() as a 4KiB entry holds it
     inline bool perm(uint64_t p) const; // are all permissions `p` enabled?
+    inline uint64_t flags() const;    // all non-address bits of va's entry
     inline bool present() const;      // is va present?
     inline bool writable() const;     // is va writable?
     inline bool user() const;         // is va user-accessible (unprivileged)?
+    inline bool huge() const;         // is va mapped by a 2MiB page?
+    inline bool cow() const;          // is va a copy-on-write page?
+    inline bool shared() const;       // is va a shared file page?
+    inline bool dirty() const;        // has va been written?
+    inline bool accessed() const;     // has va been used since cleared?
+    inline void clear_accessed();     // clear the accessed bit
+    inline bool swapped() const;      // is va's page in swap?
+    inline size_t swap_slot() const;  // swap slot of a swapped page
+    inline int swap_perm() const;     // permissions of a swapped page
 
     bool check_range(size_t sz, uint64_t perms); // check perms of range
 
@@ -45,9 +56,44 @@ class vmiter {
     // Current va must be page-aligned. Calls kallocpage() to allocate
     // page table pages if necessary. Returns 0 on success,
     // negative on failure.
-    int map(uintptr_t pa, int perm = PTE_P | PTE_W | PTE_U)
+    // If va lies in a 2MiB page, that mapping is split first.
+    // Device memory may add `PTE_WC` to `perm` for write-combining.
+    // `perm` may also be another entry's `flags()`, to move a page.
+    int map(uintptr_t pa, uint64_t perm = PTE_P | PTE_W | PTE_U)
         __attribute__((warn_unused_result));
+    // map the 2MiB region at current va to `pa` with one PS entry
+    // Current va and `pa` must be `HUGEPAGESIZE`-aligned and the region
+    // must be unmapped. Returns 0 on success, negative on failure (also
+    // if a page table page already covers the region). `map_huge(0, 0)`
+    // clears a 2MiB mapping without splitting it.
+    int map_huge(uintptr_t pa, uint64_t perm = PTE_P | PTE_W | PTE_U)
+        __attribute__((warn_unused_result));
+    // map [va, va + sz) to [pa, pa + sz) with permissions `perm`
+    // Current va, `pa`, and `sz` must be page-aligned, and `perm` must
+    // include PTE_P. Walks the page table once per page table page rather
+    // than once per page. If `huge`, uses 2MiB pages where va and `pa`
+    // are `HUGEPAGESIZE`-aligned and nothing is mapped yet. Leaves va at
+    // the end of the range. Returns 0 on success, negative on failure
+    // (part of the range may be mapped).
+    int map_range(uintptr_t pa, size_t sz,
+                  uint64_t perm = PTE_P | PTE_W | PTE_U,
+                  bool huge = false)
+        __attribute__((warn_unused_result));
+    // clear the mappings in [va, va + sz), skipping unmapped page table
+    // pages. 2MiB pages that the range only partly covers are split
+    // first. Page table pages are not freed. Leaves va at the end of the
+    // range. Returns 0 on success, negative on failure.
+    int unmap_range(size_t sz) __attribute__((warn_unused_result));
+    // like `unmap_range`, but also frees the mapped pages, like
+    // `kfree_page`
+    int kfree_range(size_t sz) __attribute__((warn_unused_result));
+    // replace the 2MiB mapping covering va with 512 4KiB mappings
+    // The 2MiB page must be an unshared `kalloc` block; it is split with
+    // `kalloc_split` so its pages can be freed one at a time. Returns 0
+    // on success (or if va is not in a 2MiB page), negative on failure.
+    int split() __attribute__((warn_unused_result));
     // free mapped page and clear mapping. Like `kfree(ka()); map(0, 0)`
+    // For a 2MiB page, va must be its first address; frees the whole page.
     inline void kfree_page();
 
   private:
@@ -61,6 +107,7 @@ class vmiter {
 
     void down();
     void real_find(uintptr_t va);
+    int clear_range(size_t sz, bool free);
 };
 
 
@@ -73,7 +120,8 @@ class vmiter {
 // }
 // freepage(pt);
 // ```
-// Note that `ptiter` will never visit the level 4 page table page.
+// Note that `ptiter` will never visit the level 4 page table page,
+// and that 2MiB pages are data, not page table pages, so it skips them.
 
 class ptiter {
   public:
@@ -143,9 +191,23 @@ inline uint64_t vmiter::perm() const {
         return 0;
     }
 }
+inline uint64_t vmiter::page_perm() const {
+    uint64_t p = perm();
+    if (huge()) {
+        // PS entries keep PAT in bit 12; 4KiB entries keep it in bit 7
+        p &= ~PTE_PS;
+        if (*pep_ & 0x1000) {
+            p |= PTE_PS;
+        }
+    }
+    return p;
+}
 inline bool vmiter::perm(uint64_t p) const {
     return (*pep_ & perm_ & p) == p;
 }
+inline uint64_t vmiter::flags() const {
+    return *pep_ & ~PTE_PAMASK;
+}
 inline bool vmiter::present() const {
     return (*pep_ & PTE_P) != 0;
 }
@@ -155,6 +217,36 @@ inline bool vmiter::writable() const {
 inline bool vmiter::user() const {
     return perm(PTE_P | PTE_U);
 }
+inline bool vmiter::huge() const {
+    return level_ == 1 && (*pep_ & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS);
+}
+inline bool vmiter::cow() const {
+    return (*pep_ & (PTE_P | PTE_COW)) == (PTE_P | PTE_COW);
+}
+inline bool vmiter::shared() const {
+    return (*pep_ & (PTE_P | PTE_SHARED)) == (PTE_P | PTE_SHARED);
+}
+inline bool vmiter::dirty() const {
+    return (*pep_ & (PTE_P | PTE_D)) == (PTE_P | PTE_D);
+}
+inline bool vmiter::accessed() const {
+    return (*pep_ & (PTE_P | PTE_A)) == (PTE_P | PTE_A);
+}
+inline void vmiter::clear_accessed() {
+    // atomic, since the processor may set other bits meanwhile
+    __atomic_fetch_and(pep_, ~PTE_A, __ATOMIC_RELAXED);
+}
+inline bool vmiter::swapped() const {
+    return level_ == 0 && (*pep_ & (PTE_P | PTE_SWAP)) == PTE_SWAP;
+}
+inline size_t vmiter::swap_slot() const {
+    assert(swapped());
+    return *pep_ >> PAGEOFFBITS;
+}
+inline int vmiter::swap_perm() const {
+    assert(swapped());
+    return *pep_ & (PTE_W | PTE_U);
+}
 inline vmiter& vmiter::find(uintptr_t va) {
     real_find(va);
     return *this;
@@ -169,7 +261,7 @@ inline void vmiter::step() {
     real_find(last_va());
 }
 inline void vmiter::kfree_page() {
-    assert((va_ & (PAGESIZE - 1)) == 0);
+    assert((va_ & (huge() ? HUGEPAGESIZE - 1 : PAGESIZE - 1)) == 0);
     if (*pep_ & PTE_P) {
         kfree(ka<void*>());
     }
@@ -0,0 +1,789 @@
+#include "kernel.hh"
+#include "k-vmiter.hh"
+#include "k-chkfs.hh"
+
+// demand-zero regions
+//    A `vmregion` is a range of user virtual memory that a page table has
+//    been promised but that is not backed yet. `vmregion_fill` backs one
+//    page at a time from the page-fault handler: read faults map the
+//    shared zero page copy-on-write, write faults map a fresh zeroed page
+//    (or a 2MiB page, if the whole aligned 2MiB chunk is in the region).
+//    File regions (program text and `mmap`) are backed by the shared pages
+//    of a disk file instead (k-textcache.cc), and shared memory regions by
+//    the pages of a segment (k-shm.cc). Regions are keyed by page
+//    table, so threads share them and `exec` starts with none. There are
+//    few regions system-wide, so they live on one list.
+//
+//    Regions placed by the kernel (`malloc`, `mmap`, shared memory) go at
+//    the lowest free address at or above `VMREGION_BASE`, so freed
+//    address space is reused. The heap is a region that starts empty
+//    after the program's data and grows and shrinks with `brk`. The
+//    stack is a region below `MEMSIZE_VIRTUAL` whose lowest pages are a
+//    guard gap that is never backed; faults that grow it back several
+//    pages at once.
+//
+//    Under memory pressure, the reclaim task evicts pages of anonymous
+//    regions to swap (k-swap.cc), choosing them with a clock: each region
+//    has a hand, `clock_`, and the regions take turns at the front of the
+//    list. Pages used since the hand last passed get another chance.
+
+struct vmregion {
+    list_links link_;
+    x86_64_pagetable* pt_;
+    uintptr_t start_;
+    uintptr_t end_;
+    int perm_;
+    bool mergeable_;            // may grow to absorb adjacent regions
+    unsigned inum_;             // file backing a file region, or 0
+    size_t off_;                // file offset of `start_`
+    bool shared_;               // file writes go back to the file
+    int shm_;                   // attached shared memory segment, or -1
+    bool heap_;                 // the program break region
+    uintptr_t brk_;             // for the heap, the break itself
+    bool stack_;                // a stack region
+    uintptr_t guard_;           // for a stack, the end of its guard gap
+    uintptr_t low_;             // for a stack, the lowest backed address
+    unsigned prefetch_;         // for a stack, pages to back when it grows
+    uintptr_t clock_;           // next address the swap clock examines
+};
+
+static list<vmregion, &vmregion::link_> vmregions;
+static spinlock vmregion_lock;  // protects `vmregions` and filling
+// page table `vmregion_swap_out` is evicting from, which must not be
+// destroyed meanwhile; `swapout_wq` is woken when it changes
+static x86_64_pagetable* swapout_pt;
+static wait_queue swapout_wq;
+x86_64_page* zero_page;
+
+
+// vmregion_find(pt, va)
+//    Return the region of `pt` containing `va`, or `nullptr`. Requires
+//    `vmregion_lock`.
+static vmregion* vmregion_find(x86_64_pagetable* pt, uintptr_t va) {
+    for (vmregion* r = vmregions.front(); r; r = vmregions.next(r)) {
+        if (r->pt_ == pt && va >= r->start_ && va < r->end_) {
+            return r;
+        }
+    }
+    return nullptr;
+}
+
+
+// vmregion_new(pt, perm, mergeable, inum, off, shared)
+//    Allocate a region with these fields and no range, or return
+//    `nullptr` if memory is short.
+static vmregion* vmregion_new(x86_64_pagetable* pt, int perm,
+                              bool mergeable, unsigned inum, size_t off,
+                              bool shared) {
+    vmregion* r = knew<vmregion>();
+    if (r) {
+        r->pt_ = pt;
+        r->start_ = r->end_ = 0;
+        r->perm_ = perm;
+        r->mergeable_ = mergeable;
+        r->inum_ = inum;
+        r->off_ = off;
+        r->shared_ = shared;
+        r->shm_ = -1;
+        r->heap_ = false;
+        r->brk_ = 0;
+        r->stack_ = false;
+        r->guard_ = r->low_ = 0;
+        r->prefetch_ = 1;
+        r->clock_ = 0;
+    }
+    return r;
+}
+
+
+// vmregion_insert(pt, start, end, perm, mergeable, inum, off, shared)
+//    Allocate a region with these fields and add it to the list. Returns
+//    0 on success and E_NOMEM on failure.
+static int vmregion_insert(x86_64_pagetable* pt, uintptr_t start,
+                           uintptr_t end, int perm, bool mergeable,
+                           unsigned inum, size_t off, bool shared) {
+    vmregion* r = vmregion_new(pt, perm, mergeable, inum, off, shared);
+    if (!r) {
+        return E_NOMEM;
+    }
+    r->start_ = start;
+    r->end_ = end;
+    auto irqs = vmregion_lock.lock();
+    vmregions.push_back(r);
+    vmregion_lock.unlock(irqs);
+    return 0;
+}
+
+
+// vmregion_unused(pt, start, end)
+//    Return the first address in `[start, end)` that `pt` uses, in a
+//    region or mapped, or `end` if there is none. Requires
+//    `vmregion_lock`.
+static uintptr_t vmregion_unused(x86_64_pagetable* pt, uintptr_t start,
+                                 uintptr_t end) {
+    uintptr_t used = end;
+    for (vmregion* r = vmregions.front(); r; r = vmregions.next(r)) {
+        if (r->pt_ == pt && r->start_ < used && r->end_ > start) {
+            used = max(r->start_, start);
+        }
+    }
+    for (vmiter it(pt, start); it.va() < used; it.next()) {
+        if (it.present()) {
+            used = it.va();
+        }
+    }
+    return used;
+}
+
+
+// vmregion_place(r, sz)
+//    Give `r` the lowest range of `sz` bytes at or above `VMREGION_BASE`
+//    that its page table doesn't use, aligned to 2MiB if it is at least
+//    that big, and add it to the list. Returns the range's start, or
+//    E_NOMEM if there is no room; then `r` is not added.
+static intptr_t vmregion_place(vmregion* r, size_t sz) {
+    assert(sz > 0 && sz % PAGESIZE == 0);
+    size_t align = sz >= HUGEPAGESIZE ? HUGEPAGESIZE : PAGESIZE;
+    auto irqs = vmregion_lock.lock();
+    uintptr_t start = VMREGION_BASE;
+    while (sz <= VA_LOWEND - start) {
+        uintptr_t used = vmregion_unused(r->pt_, start, start + sz);
+        if (used == start + sz) {
+            r->start_ = start;
+            r->end_ = start + sz;
+            vmregions.push_back(r);
+            vmregion_lock.unlock(irqs);
+            return start;
+        }
+        // skip past whatever is in the way
+        vmregion* u = vmregion_find(r->pt_, used);
+        uintptr_t next = u ? u->end_ : used + PAGESIZE;
+        if (!u) {
+            vmiter it(r->pt_, used);
+            next = it.last_va();
+        }
+        start = ROUNDUP(max(next, start + PAGESIZE), align);
+    }
+    vmregion_lock.unlock(irqs);
+    return E_NOMEM;
+}
+
+
+// vmregion_add(pt, start, end, perm, mergeable)
+//    Promise `[start, end)` to `pt` with permissions `perm`. Both bounds
+//    must be page-aligned. A `mergeable` region is combined with an
+//    adjacent mergeable region with the same permissions. Returns 0 on
+//    success, E_INVAL if part of the range is already in a region, and
+//    E_NOMEM on failure.
+int vmregion_add(x86_64_pagetable* pt, uintptr_t start, uintptr_t end,
+                 int perm, bool mergeable) {
+    assert(start % PAGESIZE == 0 && end % PAGESIZE == 0 && start < end);
+    assert(end <= VA_LOWEND);
+    vmregion* n = vmregion_new(pt, perm, mergeable, 0, 0, false);
+    if (!n) {
+        return E_NOMEM;
+    }
+    n->start_ = start;
+    n->end_ = end;
+
+    auto irqs = vmregion_lock.lock();
+    vmregion* merge = nullptr;
+    for (vmregion* r = vmregions.front(); r; r = vmregions.next(r)) {
+        if (r->pt_ != pt) {
+            continue;
+        } else if (r->start_ < end && r->end_ > start) {
+            // `vmregion_find` would hide one of the two
+            vmregion_lock.unlock(irqs);
+            kdelete(n);
+            return E_INVAL;
+        } else if (mergeable && !merge && r->mergeable_ && r->perm_ == perm
+                   && (r->end_ == start || r->start_ == end)) {
+            merge = r;
+        }
+    }
+    if (merge) {
+        merge->start_ = min(merge->start_, start);
+        merge->end_ = max(merge->end_, end);
+    } else {
+        vmregions.push_back(n);
+        n = nullptr;
+    }
+    vmregion_lock.unlock(irqs);
+    kdelete(n);
+    return 0;
+}
+
+
+// vmregion_add_file(pt, start, end, perm, inum, off, shared)
+//    Promise `[start, end)` to `pt` with permissions `perm`, backed by the
+//    shared pages of inode `inum` starting at file offset `off`. Writes
+//    to a `shared` region reach the file when it is unmapped; writes to
+//    other writable regions go to private copies. Returns 0 on success
+//    and E_NOMEM on failure.
+int vmregion_add_file(x86_64_pagetable* pt, uintptr_t start, uintptr_t end,
+                      int perm, unsigned inum, size_t off, bool shared) {
+    assert(start % PAGESIZE == 0 && end % PAGESIZE == 0 && start < end);
+    assert(end <= VA_LOWEND && off % PAGESIZE == 0 && inum != 0);
+    return vmregion_insert(pt, start, end, perm, false, inum, off, shared);
+}
+
+
+// vmregion_map(pt, sz, perm)
+//    Promise `sz` bytes (page-aligned) of zeroed memory with permissions
+//    `perm` to `pt` at an address of the kernel's choosing. Returns that
+//    address, or E_NOMEM on failure.
+intptr_t vmregion_map(x86_64_pagetable* pt, size_t sz, int perm) {
+    vmregion* r = vmregion_new(pt, perm, false, 0, 0, false);
+    intptr_t addr = r ? vmregion_place(r, sz) : E_NOMEM;
+    if (addr < 0) {
+        kdelete(r);
+    }
+    return addr;
+}
+
+
+// vmregion_map_file(pt, sz, perm, inum, off, shared)
+//    Like `vmregion_add_file`, but at an address of the kernel's choosing,
+//    which is returned. Returns E_NOMEM on failure.
+intptr_t vmregion_map_file(x86_64_pagetable* pt, size_t sz, int perm,
+                           unsigned inum, size_t off, bool shared) {
+    assert(off % PAGESIZE == 0 && inum != 0);
+    vmregion* r = vmregion_new(pt, perm, false, inum, off, shared);
+    intptr_t addr = r ? vmregion_place(r, sz) : E_NOMEM;
+    if (addr < 0) {
+        kdelete(r);
+    }
+    return addr;
+}
+
+
+// vmregion_map_shm(pt, sz, perm, id)
+//    Promise `sz` bytes with permissions `perm` to `pt` at an address of
+//    the kernel's choosing, backed by the pages of shared memory segment
+//    `id`. The region takes over the caller's attachment to the segment,
+//    also on failure. Returns the address or E_NOMEM.
+intptr_t vmregion_map_shm(x86_64_pagetable* pt, size_t sz, int perm,
+                          int id) {
+    assert(id >= 0);
+    vmregion* r = vmregion_new(pt, perm, false, 0, 0, false);
+    intptr_t addr = E_NOMEM;
+    if (r) {
+        r->shm_ = id;
+        addr = vmregion_place(r, sz);
+    }
+    if (addr < 0) {
+        shm_detach(id);
+        kdelete(r);
+    }
+    return addr;
+}
+
+
+// vmregion_add_heap(pt, base)
+//    Start `pt`'s heap, empty, at page-aligned address `base` (the end of
+//    the program's data). Returns 0 on success and E_NOMEM on failure.
+int vmregion_add_heap(x86_64_pagetable* pt, uintptr_t base) {
+    assert(base % PAGESIZE == 0 && base < VA_LOWEND);
+    vmregion* r = vmregion_new(pt, PTE_P | PTE_W | PTE_U, false, 0, 0,
+                               false);
+    if (!r) {
+        return E_NOMEM;
+    }
+    r->start_ = r->end_ = r->brk_ = base;
+    r->heap_ = true;
+    auto irqs = vmregion_lock.lock();
+    vmregions.push_back(r);
+    vmregion_lock.unlock(irqs);
+    return 0;
+}
+
+
+// vmregion_brk(pt, addr)
+//    Move `pt`'s program break to `addr`, or just return it if `addr` is
+//    0. Memory past a lowered break is freed; memory below a raised break
+//    reads as zero. Returns the new break, E_INVAL if `addr` is below the
+//    start of the heap or there is no heap, and E_NOMEM if the heap can't
+//    grow that far.
+intptr_t vmregion_brk(x86_64_pagetable* pt, uintptr_t addr) {
+    auto irqs = vmregion_lock.lock();
+    vmregion* r = vmregions.front();
+    while (r && (r->pt_ != pt || !r->heap_)) {
+        r = vmregions.next(r);
+    }
+    if (!r || (addr && addr < r->start_)) {
+        vmregion_lock.unlock(irqs);
+        return E_INVAL;
+    } else if (!addr) {
+        addr = r->brk_;
+        vmregion_lock.unlock(irqs);
+        return addr;
+    } else if (addr > VA_LOWEND - PAGESIZE) {
+        vmregion_lock.unlock(irqs);
+        return E_NOMEM;
+    }
+
+    uintptr_t end = ROUNDUP(addr, PAGESIZE);
+    uintptr_t old_end = r->end_;
+    if (end > old_end
+        && vmregion_unused(pt, old_end, end) != end) {
+        vmregion_lock.unlock(irqs);
+        return E_NOMEM;
+    }
+    r->end_ = end;
+    r->brk_ = addr;
+    vmregion_lock.unlock(irqs);
+
+    if (end < old_end) {
+        // the heap never uses 2MiB pages, so pages can be freed singly
+        tlbgather tlb(pt);
+        for (vmiter it(pt, end); it.va() < old_end; it.next()) {
+            if (it.present()) {
+                tlb.free_page(it);
+            } else if (it.swapped()) {
+                swap_free(it.swap_slot());
+                int err = it.map(0, 0);
+                assert(err == 0);
+            }
+        }
+    }
+    return addr;
+}
+
+
+// vmregion_add_stack(pt, top, size)
+//    Promise `pt` a stack that ends at page-aligned address `top` and may
+//    grow to `size` bytes, followed by a `STACK_GUARD` gap. The stack
+//    is shortened if needed to stay clear of the heap. Returns 0 on
+//    success and E_NOMEM on failure.
+int vmregion_add_stack(x86_64_pagetable* pt, uintptr_t top, size_t size) {
+    assert(top % PAGESIZE == 0 && top <= VA_LOWEND);
+    assert(size % PAGESIZE == 0 && size > 0);
+    vmregion* r = vmregion_new(pt, PTE_P | PTE_W | PTE_U, false, 0, 0,
+                               false);
+    if (!r) {
+        return E_NOMEM;
+    }
+    uintptr_t bottom = 0;
+    if (top > size + STACK_GUARD) {
+        bottom = top - size - STACK_GUARD;
+    }
+    auto irqs = vmregion_lock.lock();
+    for (vmregion* h = vmregions.front(); h; h = vmregions.next(h)) {
+        if (h->pt_ == pt && h->heap_ && h->end_ <= top) {
+            bottom = max(bottom, h->end_);
+        }
+    }
+    if (top - bottom <= STACK_GUARD
+        || vmregion_unused(pt, bottom, top - PAGESIZE) != top - PAGESIZE) {
+        vmregion_lock.unlock(irqs);
+        kdelete(r);
+        return E_NOMEM;
+    }
+    r->start_ = bottom;
+    r->end_ = r->low_ = top;
+    r->guard_ = bottom + STACK_GUARD;
+    r->stack_ = true;
+    vmregions.push_back(r);
+    vmregion_lock.unlock(irqs);
+    return 0;
+}
+
+
+// vmregion_fill_stack(r, va)
+//    Back the page containing `va`, which is unmapped and in stack region
+//    `r`. When the stack grows, up to `r->prefetch_` pages are backed at
+//    once: the faulting page, pages below it, and pages between it and
+//    the backed part of the stack. Each growth doubles the prefetch (up to
+//    `STACK_PREFETCH_MAX`), so deep recursion and large frames take few
+//    faults. Returns true if the page at `va` is now mapped. Requires
+//    `vmregion_lock`.
+static bool vmregion_fill_stack(vmregion* r, uintptr_t va) {
+    uintptr_t pg = ROUNDDOWN(va, PAGESIZE);
+    uintptr_t lo = pg, hi = pg + PAGESIZE;
+    if (pg < r->low_) {
+        size_t window = r->prefetch_ * PAGESIZE;
+        if (r->low_ - pg <= window) {
+            hi = r->low_;
+        }
+        lo = max(r->guard_, pg > window ? pg - window + PAGESIZE : 0);
+        r->low_ = lo;
+        r->prefetch_ = min(2 * r->prefetch_, unsigned(STACK_PREFETCH_MAX));
+    }
+
+    bool ok = false;
+    for (vmiter it(r->pt_, lo); it.va() < hi; it += PAGESIZE) {
+        if (it.present()) {
+            ok = ok || it.va() == pg;
+            continue;
+        }
+        x86_64_page* npg = kallocpage_zeroed();
+        if (npg && it.map(ka2pa(npg), r->perm_) >= 0) {
+            ok = ok || it.va() == pg;
+        } else {
+            kfree(npg);
+            // memory is short: settle for the faulting page
+            if (it.va() < pg) {
+                r->low_ = pg;
+                it.find(pg - PAGESIZE);
+            } else {
+                break;
+            }
+        }
+    }
+    return ok;
+}
+
+
+// vmregion_fill_file(pt, va, irqs)
+//    Map the shared file page for `va`, which is unmapped but in a file
+//    region. Called with `vmregion_lock` held; releases it, since reading
+//    the page may block. Returns true if the page is now mapped.
+static bool vmregion_fill_file(x86_64_pagetable* pt, uintptr_t va,
+                               irqstate& irqs) {
+    vmregion* r = vmregion_find(pt, va);
+    unsigned inum = r->inum_;
+    size_t off = r->off_ + (ROUNDDOWN(va, PAGESIZE) - r->start_);
+    int perm = r->perm_;
+    if (r->shared_) {
+        perm |= PTE_SHARED;
+    } else if (perm & PTE_W) {
+        // private writable mapping: copy on first write
+        perm = (perm & ~PTE_W) | PTE_COW;
+    }
+    vmregion_lock.unlock(irqs);
+
+    x86_64_page* pg = textcache_get(inum, off);
+    if (!pg) {
+        return false;
+    }
+
+    // the region may have changed or another thread mapped the page
+    irqs = vmregion_lock.lock();
+    r = vmregion_find(pt, va);
+    vmiter it(pt, ROUNDDOWN(va, PAGESIZE));
+    bool ok = r && r->inum_ == inum && it.present();
+    if (r && r->inum_ == inum && !ok && it.map(ka2pa(pg), perm) >= 0) {
+        ok = true;
+        pg = nullptr;
+    }
+    vmregion_lock.unlock(irqs);
+    kfree(pg);
+    return ok;
+}
+
+
+// vmregion_fill(pt, va, write)
+//    Back the page containing `va` if it lies in one of `pt`'s regions.
+//    Returns true if that page is now mapped (perhaps by another thread)
+//    and false if `va` is not in a region or memory ran out. May block
+//    for file regions.
+bool vmregion_fill(x86_64_pagetable* pt, uintptr_t va, bool write) {
+    auto irqs = vmregion_lock.lock();
+    vmregion* r = vmregion_find(pt, va);
+    vmiter it(pt, ROUNDDOWN(va, PAGESIZE));
+    bool ok = r && it.present();
+    if (r && !ok && it.swapped()) {
+        vmregion_lock.unlock(irqs);
+        return swap_in(pt, va);
+    }
+    if (r && !ok && r->stack_) {
+        // faults in the guard gap are stack overflows
+        ok = va >= r->guard_ && vmregion_fill_stack(r, va);
+        vmregion_lock.unlock(irqs);
+        return ok;
+    }
+    if (r && !ok && r->inum_) {
+        if (write && !(r->perm_ & PTE_W)) {
+            vmregion_lock.unlock(irqs);
+            return false;
+        }
+        return vmregion_fill_file(pt, va, irqs);
+    }
+    if (r && !ok && r->shm_ >= 0) {
+        size_t i = (ROUNDDOWN(va, PAGESIZE) - r->start_) / PAGESIZE;
+        if (x86_64_page* pg = shm_page(r->shm_, i)) {
+            ok = it.map(ka2pa(pg), r->perm_ | PTE_SHARED) >= 0;
+            if (!ok) {
+                kfree(pg);
+            }
+        }
+        vmregion_lock.unlock(irqs);
+        return ok;
+    }
+
+    // writes get 2MiB pages where the whole aligned chunk is promised
+    // and no page table page covers it yet
+    uintptr_t chunk = ROUNDDOWN(va, HUGEPAGESIZE);
+    if (r && !ok && write && !r->heap_
+        && chunk >= r->start_ && chunk + HUGEPAGESIZE <= r->end_) {
+        vmiter cit(pt, chunk);
+        if (!cit.present() && cit.last_va() - chunk >= HUGEPAGESIZE) {
+            if (void* hp = kalloc_zeroed(HUGEPAGESIZE)) {
+                ok = cit.map_huge(ka2pa(hp), r->perm_) >= 0;
+                if (!ok) {
+                    kfree(hp);
+                }
+            }
+        }
+    }
+
+    if (r && !ok && (write || !(r->perm_ & PTE_W))) {
+        if (x86_64_page* pg = kallocpage_zeroed()) {
+            ok = it.map(ka2pa(pg), r->perm_) >= 0;
+            if (!ok) {
+                kfree(pg);
+            }
+        }
+    } else if (r && !ok) {
+        // read of writable memory: share the zero page until written
+        if (!zero_page) {
+            zero_page = kallocpage_zeroed();
+        }
+        if (zero_page) {
+            int perm = (r->perm_ & ~PTE_W) | PTE_COW;
+            ok = it.map(ka2pa(zero_page), perm) >= 0;
+            if (ok) {
+                kalloc_ref(zero_page);
+            }
+        }
+    }
+    vmregion_lock.unlock(irqs);
+    return ok;
+}
+
+
+// vmregion_prefault(pt, addr, sz, write)
+//    Back every unmapped page of `[addr, addr + sz)` that lies in a region
+//    of `pt`. The kernel calls this before checking a user buffer, since
+//    such pages are not mapped until touched.
+void vmregion_prefault(x86_64_pagetable* pt, uintptr_t addr, size_t sz,
+                       bool write) {
+    if (vmregions.empty() || sz == 0 || addr + sz > VA_LOWEND
+        || addr + sz < addr) {
+        return;
+    }
+    for (vmiter it(pt, ROUNDDOWN(addr, PAGESIZE));
+         it.va() < addr + sz;
+         it += PAGESIZE) {
+        if (!it.present()) {
+            vmregion_fill(pt, it.va(), write);
+        }
+    }
+}
+
+
+// vmregion_copy(from, to)
+//    Give page table `to` copies of `from`'s regions (for `fork`). Returns
+//    0 on success and E_NOMEM on failure.
+int vmregion_copy(x86_64_pagetable* from, x86_64_pagetable* to) {
+    list<vmregion, &vmregion::link_> copies;
+    auto irqs = vmregion_lock.lock();
+    for (vmregion* r = vmregions.front(); r; r = vmregions.next(r)) {
+        if (r->pt_ != from) {
+            continue;
+        }
+        vmregion* c = knew<vmregion>();
+        if (!c) {
+            vmregion_lock.unlock(irqs);
+            while (vmregion* dead = copies.pop_front()) {
+                if (dead->shm_ >= 0) {
+                    shm_detach(dead->shm_);
+                }
+                kdelete(dead);
+            }
+            return E_NOMEM;
+        }
+        c->pt_ = to;
+        c->start_ = r->start_;
+        c->end_ = r->end_;
+        c->perm_ = r->perm_;
+        c->mergeable_ = r->mergeable_;
+        c->inum_ = r->inum_;
+        c->off_ = r->off_;
+        c->shared_ = r->shared_;
+        c->shm_ = r->shm_;
+        c->heap_ = r->heap_;
+        c->brk_ = r->brk_;
+        c->stack_ = r->stack_;
+        c->guard_ = r->guard_;
+        c->low_ = r->low_;
+        c->prefetch_ = r->prefetch_;
+        c->clock_ = r->start_;
+        if (c->shm_ >= 0) {
+            shm_attach(c->shm_);
+        }
+        copies.push_back(c);
+    }
+    while (vmregion* c = copies.pop_front()) {
+        vmregions.push_back(c);
+    }
+    vmregion_lock.unlock(irqs);
+    return 0;
+}
+
+
+// vmregion_unmap(pt, r, tlb)
+//    Unmap and free the pages of `r`, which is no longer on the list, and
+//    detach its shared memory segment. Dirty pages of a shared file region
+//    are written back to the file first, so this may block. If `pt` is
+//    live, `tlb` is a batch for it, which invalidates the pages on every
+//    CPU before they are freed; otherwise `tlb` is `nullptr`.
+static void vmregion_unmap(x86_64_pagetable* pt, vmregion* r,
+                           tlbgather* tlb) {
+    if (!tlb && !r->shared_) {
+        // nothing to write back or shoot down: free in bulk
+        int err = vmiter(pt, r->start_).kfree_range(r->end_ - r->start_);
+        assert(err == 0);
+    } else {
+        for (vmiter it(pt, r->start_); it.va() < r->end_; it.next()) {
+            if (it.swapped()) {
+                swap_free(it.swap_slot());
+                int err = it.map(0, 0);
+                assert(err == 0);
+            }
+            if (!it.present()) {
+                continue;
+            }
+            uintptr_t va = it.va();
+            if (r->shared_ && it.dirty()) {
+                chickadeefs_write_inode_data(r->inum_, it.ka<void*>(),
+                                             PAGESIZE,
+                                             r->off_ + (va - r->start_));
+            }
+            // frees a whole 2MiB page at once; `next()` then skips it
+            if (tlb) {
+                tlb->free_page(it);
+            } else {
+                it.kfree_page();
+            }
+        }
+    }
+    if (tlb) {
+        tlb->flush();
+    }
+    if (r->shm_ >= 0) {
+        shm_detach(r->shm_);
+    }
+}
+
+
+// vmregion_free(pt, start, sz)
+//    Unmap and free the pages of `pt`'s non-mergeable region starting at
+//    `start`, then forget the region. If `sz` is nonzero, it must match
+//    the region's size rounded up to pages. Returns 0 on success and
+//    E_INVAL if there is no such region.
+int vmregion_free(x86_64_pagetable* pt, uintptr_t start, size_t sz) {
+    auto irqs = vmregion_lock.lock();
+    vmregion* r = vmregion_find(pt, start);
+    if (!r || r->start_ != start || r->mergeable_ || r->heap_
+        || (sz && ROUNDUP(sz, PAGESIZE) != r->end_ - r->start_)) {
+        vmregion_lock.unlock(irqs);
+        return E_INVAL;
+    }
+    vmregions.erase(r);
+    vmregion_lock.unlock(irqs);
+
+    tlbgather tlb(pt);
+    vmregion_unmap(pt, r, &tlb);
+    kdelete(r);
+    return 0;
+}
+
+
+// vmregion_clear(pt)
+//    Free every page still mapped in `pt`'s regions and forget the
+//    regions. Called when `pt` is destroyed. May block.
+void vmregion_clear(x86_64_pagetable* pt) {
+    list<vmregion, &vmregion::link_> dead;
+    auto irqs = vmregion_lock.lock();
+    waiter(current()).block_until(swapout_wq, [&] () {
+        return swapout_pt != pt;
+    }, vmregion_lock, irqs);
+    vmregion* next;
+    for (vmregion* r = vmregions.front(); r; r = next) {
+        next = vmregions.next(r);
+        if (r->pt_ == pt) {
+            vmregions.erase(r);
+            dead.push_back(r);
+        }
+    }
+    vmregion_lock.unlock(irqs);
+
+    while (vmregion* r = dead.pop_front()) {
+        vmregion_unmap(pt, r, nullptr);
+        kdelete(r);
+    }
+}
+
+
+// vmregion_swap_pick(pt, va)
+//    Advance the swap clock to a page of an anonymous region that hasn't
+//    been used since the clock last passed it. Clears the accessed bits
+//    of pages passed over. Returns false if a full turn found nothing.
+//    Requires `vmregion_lock`.
+static bool vmregion_swap_pick(x86_64_pagetable*& pt, uintptr_t& va) {
+    size_t nregions = 0;
+    for (vmregion* r = vmregions.front(); r; r = vmregions.next(r)) {
+        ++nregions;
+    }
+    // two turns: the first may only clear accessed bits
+    for (size_t n = 0; n != 2 * nregions; ++n) {
+        vmregion* r = vmregions.front();
+        if (!r->inum_ && r->shm_ < 0 && !r->shared_) {
+            vmiter it(r->pt_, max(r->clock_, r->start_));
+            for (; it.va() < r->end_; it.next()) {
+                if (!it.present() || it.huge() || !it.user()
+                    || !it.writable()) {
+                    continue;
+                } else if (it.accessed()) {
+                    it.clear_accessed();
+                } else {
+                    pt = r->pt_;
+                    va = it.va();
+                    r->clock_ = va + PAGESIZE;
+                    return true;
+                }
+            }
+        }
+        // this region's turn is over
+        r->clock_ = r->start_;
+        vmregions.erase(r);
+        vmregions.push_back(r);
+    }
+    return false;
+}
+
+
+// vmregion_swap_out(want)
+//    Evict up to `want` pages of anonymous regions to swap. Returns the
+//    number of pages freed. Blocks; called by the reclaim task.
+size_t vmregion_swap_out(size_t want) {
+    if (!swap_init()) {
+        return 0;
+    }
+    size_t nfreed = 0;
+    for (size_t tries = 0; nfreed < want && tries < 4 * want; ++tries) {
+        x86_64_pagetable* pt;
+        uintptr_t va;
+        auto irqs = vmregion_lock.lock();
+        if (!vmregion_swap_pick(pt, va)) {
+            vmregion_lock.unlock(irqs);
+            break;
+        }
+        // `vmregion_clear` waits, so `pt` outlives the eviction
+        swapout_pt = pt;
+        vmregion_lock.unlock(irqs);
+
+        int r = swap_out_page(pt, va);
+
+        irqs = vmregion_lock.lock();
+        swapout_pt = nullptr;
+        swapout_wq.wake_all();
+        vmregion_lock.unlock(irqs);
+        if (r < 0) {
+            break;
+        }
+        nfreed += r;
+    }
+    return nfreed;
+}
@@ -98,8 +98,10 @@ void process_setup(pid_t pid, const char* name) {
 
     int r = p->load(name);
     assert(r >= 0 && "probably a bad process name");
+    r = vmregion_add_stack(npt, MEMSIZE_VIRTUAL, STACK_SIZE_MAX);
+    assert(r >= 0);
     p->regs_->reg_rsp = MEMSIZE_VIRTUAL;
-    x86_64_page* stkpg = kallocpage();
+    x86_64_page* stkpg = kallocpage_zeroed();
     assert(stkpg);
     r = vmiter(p, MEMSIZE_VIRTUAL - PAGESIZE).map(ka2pa(stkpg));
     p->regs_->reg_rsp -= 8;     // align stack by 16 bytes
@@ -235,23 +237,115 @@ void process_exit(proc* p, int status = 0) {
 }
 
 
-// nuke_pagetable(pt)
-//    Wipes all memory associated with pagetable pt. MUST be called on an L4 pt
-void nuke_pagetable(x86_64_pagetable* pt) {
-    // free virtual memory
-    for (vmiter vmit(pt); vmit.va() < MEMSIZE_VIRTUAL; vmit.next()) {
-        if (vmit.user() && vmit.writable() && vmit.pa() != ktext2pa(console)) {
-            kfree(reinterpret_cast<void*>(pa2ka(vmit.pa())));
-            assert(vmiter(pt, vmit.va()).map(0x0) >= 0);
+// cow_lock
+//    Serializes sharing and unsharing copy-on-write pages, so threads
+//    that fault on the same page don't both copy it. Swap-out and swap-in
+//    (k-swap.cc) change mappings under it too.
+spinlock cow_lock;
+
+
+// break_cow(p, va)
+//    Give `p` a private, writable copy of the copy-on-write page at `va`.
+//    Returns 0 on success (also if another thread got there first) and
+//    E_NOMEM on failure.
+static int break_cow(proc* p, uintptr_t va) {
+    int r = 0;
+    // other threads' CPUs may cache the old page; the batch invalidates
+    // it everywhere and frees it after `cow_lock` is released
+    tlbgather tlb(p->pagetable_);
+    auto irqs = cow_lock.lock();
+    vmiter it(p, ROUNDDOWN(va, PAGESIZE));
+    if (it.cow()) {
+        void* old = it.ka<void*>();
+        int perm = it.perm() | PTE_W;
+        if (!kalloc_shared(old)) {
+            // last reference: keep the page
+            r = it.map(it.pa(), perm);
+        } else if (old == zero_page) {
+            x86_64_page* npg = kallocpage_zeroed();
+            r = npg ? it.map(ka2pa(npg), perm) : E_NOMEM;
+            if (r < 0) {
+                kfree(npg);
+            } else {
+                tlb.free(old);
+            }
+        } else if (void* npg = kallocpage()) {
+            memcpy(npg, old, PAGESIZE);
+            r = it.map(ka2pa(npg), perm);
+            if (r < 0) {
+                kfree(npg);
+            } else {
+                tlb.free(old);
+            }
+        } else {
+            r = E_NOMEM;
         }
+        tlb.add(it.va(), PAGESIZE);
     }
+    cow_lock.unlock(irqs);
+    return r < 0 ? E_NOMEM : 0;
+}
 
-    // free L3-L1 pagetables
-    for (ptiter ptit(pt, 0); ptit.low(); ptit.next()) {
-        kfree(reinterpret_cast<void*>(pa2ka(ptit.ptp_pa())));
+
+// nuke_ptp(ptp, level, va, nb)
+//    Free the user pages below `MEMSIZE_VIRTUAL` mapped through page
+//    table page `ptp`, which is at `level` (3 for the L4 table) and
+//    starts at address `va`, then the page table pages below `ptp`. The
+//    table is walked directly and its entries are left alone, since the
+//    tables are about to be freed. Pages are freed in batches via `nb`.
+struct nukebatch {
+    void* ptrs_[32];
+    size_t n_ = 0;
+};
+
+static void nuke_ptp(x86_64_pagetable* ptp, int level, uintptr_t va,
+                     nukebatch& nb) {
+    // only the low half of the L4 table belongs to the process
+    int nentries = level == 3 ? 256 : 512;
+    for (int i = 0; i != nentries; ++i) {
+        x86_64_pageentry_t pe = ptp->entry[i];
+        uintptr_t eva = va
+            + (uintptr_t(i) << (PAGEOFFBITS + level * PAGEINDEXBITS));
+        bool leaf = level == 0 || (level == 1 && (pe & PTE_PS));
+        void* ka = nullptr;
+        if (!(pe & PTE_P)) {
+            continue;
+        } else if (!leaf) {
+            ka = pa2ka<void*>(pe & PTE_PAMASK);
+            nuke_ptp(reinterpret_cast<x86_64_pagetable*>(ka), level - 1,
+                     eva, nb);
+        } else if (eva < MEMSIZE_VIRTUAL
+                   && (pe & PTE_U) && (pe & (PTE_W | PTE_COW))
+                   && (pe & PTE_PAMASK) != ktext2pa(console)) {
+            // 2MiB entries keep the PAT bit where 4KiB ones have address
+            ka = pa2ka<void*>(pe & PTE_PAMASK & ~(level ? 0x1000UL : 0));
+        }
+        if (ka) {
+            if (nb.n_ == arraysize(nb.ptrs_)) {
+                kfree_batch(nb.ptrs_, nb.n_);
+                nb.n_ = 0;
+            }
+            nb.ptrs_[nb.n_] = ka;
+            ++nb.n_;
+        }
     }
+}
 
-    // free L4 pagetable
+
+// nuke_pagetable(pt)
+//    Wipes all memory associated with pagetable pt. MUST be called on an L4 pt
+void nuke_pagetable(x86_64_pagetable* pt) {
+    // free region memory first: shared file pages are written back, and
+    // must not be freed as ordinary writable pages
+    vmregion_clear(pt);
+
+    // free virtual memory and L3-L1 pagetables
+    nukebatch nb;
+    nuke_ptp(pt, 3, 0, nb);
+    kfree_batch(nb.ptrs_, nb.n_);
+
+    // free L4 pagetable; no CPU may reuse translations cached for it
+    invalidate_pagetables();
     kdelete(pt);
 }
 
@@ -274,16 +368,21 @@ int process_reap(pid_t pid) {
         }
     }
 
+    // wipe everything else once the lock is released: writing back
+    // shared file mappings may block
+    x86_64_pagetable* dead_pt = nullptr;
     if (nthr == 1) {
-        // wipe everything else
         kdelete(p->fdtable_);
-        nuke_pagetable(p->pagetable_);
+        dead_pt = p->pagetable_;
     }
 
     int exit_status = p->exit_status_;
-    kfree(p);
+    kfree_proc(p);
     ptable[pid] = true_ptable[pid] = nullptr;
     ptable_lock.unlock(irqs);
+    if (dead_pt) {
+        nuke_pagetable(dead_pt);
+    }
     debug_printf("[%d] reaped pid %d, %d active threads\n",
         current()->pid_, pid, nthr);
     waitpid_wq.wake_all();
@@ -292,6 +391,40 @@ int process_reap(pid_t pid) {
 
 
 
+// fdtable_copy(from, to)
+//    Give empty fdtable `to` new references to the files of `from`.
+
+static void fdtable_copy(fdtable* from, fdtable* to) {
+    auto irqs = from->lock_.lock();
+    for (unsigned i = 0; i < NFDS; i++) {
+        auto f = to->fds_[i] = from->fds_[i];
+        if (!f) {
+            continue;
+        }
+        f->lock_.lock_noirq();
+        f->refs_++;
+        f->vnode_->lock_.lock_noirq();
+        f->lock_.unlock_noirq();
+        f->vnode_->refs_++;
+        f->vnode_->lock_.unlock_noirq();
+    }
+    from->lock_.unlock(irqs);
+}
+
+
+// fdtable_free(fdt)
+//    Drop `fdt`'s file references and free it.
+
+static void fdtable_free(fdtable* fdt) {
+    for (unsigned i = 0; i < NFDS; i++) {
+        if (fdt->fds_[i]) {
+            fdt->fds_[i]->deref();
+        }
+    }
+    kdelete(fdt);
+}
+
+
 // process_fork(ogproc, ogregs)
 //    Fork the process ogproc into the first available pid.
 static pid_t process_fork(proc* ogproc, regstate* ogregs) {
@@ -328,7 +461,7 @@ static pid_t process_fork(proc* ogproc, regstate* ogregs) {
     if (!fpt) {
         irqs = ptable_lock.lock();
         ptable[fpid] = true_ptable[fpid] = nullptr;
-        kdelete(fproc);
+        kfree_proc(fproc);
         ptable_lock.unlock(irqs);
         return E_NOMEM;
     }
@@ -341,37 +474,86 @@ static pid_t process_fork(proc* ogproc, regstate* ogregs) {
     if (!fproc->fdtable_) {
         irqs = ptable_lock.lock();
         kdelete(fpt);
-        kdelete(fproc);
+        kfree_proc(fproc);
         ptable[fpid] = nullptr;
         ptable_lock.unlock(irqs);
         return E_NOMEM;
     }
 
     // clone ogproc's fdtable
-    auto fdt_irqs = ogproc->fdtable_->lock_.lock();
-    for (unsigned i = 0; i < NFDS && ogproc->fdtable_->fds_[i]; i++) {
-        auto f = fproc->fdtable_->fds_[i] = ogproc->fdtable_->fds_[i];
-        f->lock_.lock_noirq();
-        f->refs_++;
-        f->vnode_->lock_.lock_noirq();
-        f->lock_.unlock_noirq();
-        f->vnode_->refs_++;
-        f->vnode_->lock_.unlock_noirq();
-    }
-    ogproc->fdtable_->lock_.unlock(fdt_irqs);
+    fdtable_copy(ogproc->fdtable_, fproc->fdtable_);
 
     // set up process hierarchy
     fproc->ppid_ = ogproc->pid_;
     ogproc->children_.push_back(fproc);
 
 
-    // 3. Copy the parent process’s user-accessible memory and map the copies
-    // into the new process’s page table.
+    // untouched demand-zero and text regions stay untouched in both; copy
+    // them first so `process_reap` frees region pages mapped below
+    if (vmregion_copy(ogproc->pagetable_, fpt) < 0) {
+        process_reap(fpid);
+        return E_NOMEM;
+    }
+
+    // 3. Share the parent process’s user-accessible memory with the child.
+    // Writable single pages become read-only copy-on-write pages in both;
+    // `break_cow` copies them on the first write. 2MiB pages are split
+    // first, so they are shared a page at a time. Other writable memory
+    // (pieces of larger blocks) is copied now. Pages of shared file
+    // mappings stay shared.
+    // (`tlb` also flushes when an error below returns)
+    tlbgather tlb(ogproc->pagetable_);
+    tlb.add(0, VA_LOWEND);
+    auto cow_irqs = cow_lock.lock();
     for (vmiter source(ogproc); source.low(); source.next()) {
-        if (source.user() && source.writable()
+        if (source.user() && source.writable() && source.huge()
+            && kalloc_size(source.ka<void*>()) == HUGEPAGESIZE
+            && !kalloc_shared(source.ka<void*>())
+            && source.split() < 0) {
+            cow_lock.unlock(cow_irqs);
+            process_reap(fpid);
+            return E_NOMEM;
+        }
+        if (source.swapped()) {
+            // both copies can read the page back from the same slot
+            swap_ref(source.swap_slot());
+            if (vmiter(fpt, source.va()).map(
+                    source.swap_slot() << PAGEOFFBITS,
+                    PTE_SWAP | source.swap_perm()) < 0) {
+                swap_free(source.swap_slot());
+                cow_lock.unlock(cow_irqs);
+                process_reap(fpid);
+                return E_NOMEM;
+            }
+        }
+        else if (source.user() && source.shared()) {
+            int perm = source.perm() | PTE_SHARED;
+            kalloc_ref(source.ka<void*>());
+            if (vmiter(fpt, source.va()).map(source.pa(), perm) < 0) {
+                kfree(source.ka<void*>());
+                cow_lock.unlock(cow_irqs);
+                process_reap(fpid);
+                return E_NOMEM;
+            }
+        }
+        else if (source.user() && (source.writable() || source.cow())
+                && source.pa() != ktext2pa(console) && !source.huge()
+                && kalloc_size(source.ka<void*>()) == PAGESIZE) {
+            int perm = (source.perm() & ~PTE_W) | PTE_COW;
+            kalloc_ref(source.ka<void*>());
+            if (source.map(source.pa(), perm) < 0
+                || vmiter(fpt, source.va()).map(source.pa(), perm) < 0) {
+                kfree(source.ka<void*>());
+                cow_lock.unlock(cow_irqs);
+                process_reap(fpid);
+                return E_NOMEM;
+            }
+        }
+        else if (source.user() && source.writable()
                 && source.pa() != ktext2pa(console)) {
             void* npage_ka = kallocpage();
             if (npage_ka == nullptr) {
+                cow_lock.unlock(cow_irqs);
                 process_reap(fpid);
                 return E_NOMEM;
             }
@@ -379,19 +561,36 @@ static pid_t process_fork(proc* ogproc, regstate* ogregs) {
 
             memcpy(npage_ka, reinterpret_cast<void*>(pa2ka(source.pa())),
                 PAGESIZE);
-            if (vmiter(fpt, source.va()).map(npage_pa, source.perm()) < 0) {
+            if (vmiter(fpt, source.va()).map(npage_pa, source.page_perm())
+                < 0) {
                 kfree(npage_ka);
+                cow_lock.unlock(cow_irqs);
                 process_reap(fpid);
                 return E_NOMEM;
             }
         }
         else if (source.user()) {
-            if (vmiter(fpt, source.va()).map(source.pa(), source.perm()) < 0) {
+            // read-only allocated pages (shared text) gain a reference
+            void* ka = source.ka<void*>();
+            bool refd = source.pa() != ktext2pa(console) && kalloc_size(ka);
+            if (refd) {
+                kalloc_ref(ka);
+            }
+            if (vmiter(fpt, source.va()).map(source.pa(), source.page_perm())
+                < 0) {
+                if (refd) {
+                    kfree(ka);
+                }
+                cow_lock.unlock(cow_irqs);
                 process_reap(fpid);
                 return E_NOMEM;
             }
         }
     }
+    cow_lock.unlock(cow_irqs);
+    // flush the parent's writable TLB entries for pages now shared, on
+    // every CPU, before the child can run
+    tlb.flush();
 
     // 4. Initialize the new process’s registers to a copy of the old process’s
     // registers.
@@ -443,11 +642,12 @@ int seppuku() {
 //    valid address space.
 
 bool validate_memory(uintptr_t addr, size_t sz = 0, int perms = 0) {
-    return !(!addr
-             || addr + sz > VA_LOWEND
-             || addr > VA_HIGHMAX - sz
-             || (sz > 0 ? !vmiter(current(), addr).check_range(sz, perms)
-                        : false));
+    if (!addr || addr + sz > VA_LOWEND || addr > VA_HIGHMAX - sz) {
+        return false;
+    }
+    // untouched demand-zero pages aren't mapped yet
+    vmregion_prefault(current()->pagetable_, addr, sz, perms & PTE_W);
+    return sz == 0 || vmiter(current(), addr).check_range(sz, perms);
 }
 
 template <typename T>
@@ -497,6 +697,237 @@ int get_proc_slot(proc** ptab) {
 }
 
 
+// exec_check(program_name, argv, argc)
+//    Check the user's arguments to `execv` or `spawn`: `argv` must hold
+//    `argc > 0` strings followed by a null pointer. Returns the length of
+//    `program_name`, or an error code.
+
+static int exec_check(const char* program_name, const char* const* argv,
+                      size_t argc) {
+    int name_sz = check_string_termination(program_name, memfile::namesize);
+    if (name_sz < 0) {
+        return name_sz;
+    } else if (argc < 1) {
+        return E_INVAL;
+    } else if (argc > PAGESIZE / sizeof(char*)) {
+        return E_2BIG;
+    } else if (!validate_memory(argv, (argc + 1) * 8, PTE_P | PTE_U)) {
+        return E_FAULT;
+    } else if (!argv[0] || argv[argc]) {
+        return E_INVAL;
+    }
+    for (size_t i = 0; i != argc; ++i) {
+        int r = check_string_termination(argv[i], memfile::namesize);
+        if (r < 0) {
+            return r;
+        }
+    }
+    return name_sz;
+}
+
+
+// exec_image
+//    A program loaded by `exec_load`: its new page table, with the
+//    argument strings on the top stack page, and its initial registers.
+
+struct exec_image {
+    x86_64_pagetable* pagetable_;
+    uintptr_t rip_;
+    uintptr_t rsp_;
+    size_t argc_;
+    uintptr_t argv_;
+
+    // set up registers (after `init_user`) to start the program
+    void start(regstate* regs) const {
+        regs->reg_rip = rip_;
+        regs->reg_rdi = argc_;
+        regs->reg_rsi = argv_;
+        regs->reg_rsp = regs->reg_rbp = rsp_;
+    }
+};
+
+
+// exec_load(program_name, name_sz, argv, argc, img)
+//    Load `program_name` into a fresh page table, with copies of the
+//    argument strings `argv` (checked by `exec_check`) at the top of its
+//    stack. Fills in `img` and returns 0, or returns an error code.
+
+static int exec_load(const char* program_name, size_t name_sz,
+                     const char* const* argv, size_t argc,
+                     exec_image& img) {
+    // get the total length of the argv array
+    size_t argv_len = 0;
+    for (size_t i = 0; i < argc; i++) {
+        argv_len += strlen(argv[i]) + 1;
+    }
+
+    // get the amount of memory for the ptrs to strings
+    size_t sz_argv_ptrs = 8 * (argc + 1);
+
+    // 8-byte align argv_len; everything must fit on the stack page
+    size_t mem_diff = ROUNDUP(argv_len, 8) + sz_argv_ptrs;
+    if (mem_diff > PAGESIZE - 16) {
+        return E_2BIG;
+    }
+
+    // allocate all the memory
+    auto npt = kalloc_pagetable();
+    auto stkpg = kallocpage_zeroed();
+    if (!npt || !stkpg) {
+        kdelete(npt);
+        kdelete(stkpg);
+        return E_NOMEM;
+    }
+
+    // load program
+    disk_loader dl;
+    dl.pagetable_ = npt;
+    memcpy(dl.name_, program_name, name_sz);
+    int r = proc::load(dl);
+    if (r >= 0) {
+        r = vmregion_add_stack(npt, MEMSIZE_VIRTUAL, STACK_SIZE_MAX);
+    }
+    if (r < 0) {
+        nuke_pagetable(npt);
+        kfree(stkpg);
+        return r;
+    }
+
+    // copy each string to the top of the stack page
+    auto stkpg_top = reinterpret_cast<uintptr_t>(stkpg) + PAGESIZE;
+    size_t arg_len = 0;
+    for (size_t i = 0; i < argc; i++) {
+        // copy string to stack page
+        memcpy(reinterpret_cast<void*>(
+                stkpg_top - mem_diff + sz_argv_ptrs + arg_len),
+            argv[i], strlen(argv[i]) + 1);
+
+        // copy pointer to string to stack page
+        uintptr_t argv_ptr =
+            MEMSIZE_VIRTUAL - mem_diff + sz_argv_ptrs + arg_len;
+        memcpy(reinterpret_cast<void*>(stkpg_top - mem_diff + 8 * i),
+            &argv_ptr, 8);
+
+        arg_len += strlen(argv[i]) + 1;
+    }
+    // null-terminate argv pointer array
+    *reinterpret_cast<void**>(stkpg_top - mem_diff + sz_argv_ptrs - 8) =
+        nullptr;
+
+    // map stackpage and console into vm
+    if (vmiter(npt, MEMSIZE_VIRTUAL - PAGESIZE).map(ka2pa(stkpg),
+                                        PTE_P | PTE_W | PTE_U) < 0) {
+        nuke_pagetable(npt);
+        kfree(stkpg);
+        return E_NOMEM;
+    }
+    if (vmiter(npt, ktext2pa(console)).map(ktext2pa(console),
+                                        PTE_P | PTE_W | PTE_U) < 0) {
+        nuke_pagetable(npt);
+        return E_NOMEM;
+    }
+
+    img.pagetable_ = npt;
+    img.rip_ = dl.entry_rip_;
+    img.argc_ = argc;
+    img.argv_ = MEMSIZE_VIRTUAL - mem_diff;
+
+    // set rsp to bottom of argv data, aligned by 16 bytes
+    uintptr_t below_argv = MEMSIZE_VIRTUAL - mem_diff - 8;
+    if (below_argv % 16 != 0) below_argv = ((below_argv / 16) - 1) * 16;
+    img.rsp_ = below_argv;
+    return 0;
+}
+
+
+// process_spawn(p, program_name, argv, argc, actions, nactions)
+//    Start `program_name` in a new child of `p`, as `fork` followed by
+//    `execv` would, without copying `p`'s memory. The child's file
+//    descriptors start as copies of `p`'s; then the `nactions` file
+//    actions at `actions` are applied to them in order. Returns the
+//    child's pid or an error code.
+
+static pid_t process_spawn(proc* p, const char* program_name,
+                           const char* const* argv, size_t argc,
+                           const spawn_fdaction* actions, size_t nactions) {
+    int name_sz = exec_check(program_name, argv, argc);
+    if (name_sz < 0) {
+        return name_sz;
+    } else if (nactions > 2 * NFDS
+               || (nactions && !validate_memory(actions,
+                                                nactions * sizeof(*actions),
+                                                PTE_P | PTE_U))) {
+        return E_FAULT;
+    }
+
+    debug_printf("[%d] sys_spawn '%s' argc = %d\n",
+        p->pid_, program_name, argc);
+
+    // build the child's file descriptors
+    fdtable* fdt = knew<fdtable>();
+    if (!fdt) {
+        return E_NOMEM;
+    }
+    fdtable_copy(p->fdtable_, fdt);
+    for (size_t i = 0; i != nactions; ++i) {
+        int fd = actions[i].fd;
+        int newfd = actions[i].newfd;
+        if (fd < 0 || fd >= NFDS || !fdt->fds_[fd]
+            || (actions[i].op == SPAWN_DUP2 && (newfd < 0 || newfd >= NFDS))
+            || (actions[i].op != SPAWN_DUP2
+                && actions[i].op != SPAWN_CLOSE)) {
+            fdtable_free(fdt);
+            return actions[i].op == SPAWN_DUP2
+                || actions[i].op == SPAWN_CLOSE ? E_BADF : E_INVAL;
+        }
+        if (actions[i].op == SPAWN_DUP2 && fd != newfd) {
+            if (fdt->fds_[newfd]) {
+                fdt->fds_[newfd]->deref();
+            }
+            fdt->fds_[newfd] = fdt->fds_[fd];
+            fdt->fds_[fd]->refs_++;
+        } else if (actions[i].op == SPAWN_CLOSE) {
+            fdt->fds_[fd]->deref();
+            fdt->fds_[fd] = nullptr;
+        }
+    }
+
+    // load the program
+    exec_image img;
+    int r = exec_load(program_name, name_sz, argv, argc, img);
+    if (r < 0) {
+        fdtable_free(fdt);
+        return r;
+    }
+
+    // allocate the child
+    auto irqs = ptable_lock.lock();
+    pid_t cpid = get_proc_slot(ptable);
+    proc* cp = cpid > 0 ? kalloc_proc() : nullptr;
+    if (!cp) {
+        ptable_lock.unlock(irqs);
+        nuke_pagetable(img.pagetable_);
+        fdtable_free(fdt);
+        return cpid > 0 ? E_NOMEM : E_MFILE;
+    }
+    ptable[cpid] = true_ptable[cpid] = cp;
+    cp->state_ = proc::broken;
+    ptable_lock.unlock(irqs);
+
+    cp->init_user(cpid, img.pagetable_);
+    img.start(cp->regs_);
+    cp->fdtable_ = fdt;
+    cp->ppid_ = p->pid_;
+    p->children_.push_back(cp);
+
+    int cpu = cp->cpu_ = cpid % ncpu;
+    cpus[cpu].runq_lock_.lock_noirq();
+    cpus[cpu].enqueue(cp);
+    cpus[cpu].runq_lock_.unlock_noirq();
+    return cpid;
+}
+
+
 // proc::exception(reg)
 //    Exception handler (for interrupts, traps, and faults).
 //
@@ -539,24 +970,34 @@ void proc::exception(regstate* regs) {
     case INT_PAGEFAULT: {
         uintptr_t addr = rcr2();
 
-        // need more stack space?
-        if (addr <= regs->reg_rsp && addr > regs->reg_rsp - 64) {
-            debug_printf("PAGEFAULT:\n"
-                "\taddr:%p\n"
-                "\t%%rip:%p\n"
-                "\t%%rsp:%p\n"
-                "\t%%rsp-64:%p\n",
-                addr, regs->reg_rip, regs->reg_rsp, regs->reg_rsp - 64);
-
-            auto npg = reinterpret_cast<uintptr_t>(kallocpage());
-            if (!npg || vmiter(this, ROUNDDOWN(addr, PAGESIZE)).map(
-                                        ka2pa(npg), PTE_P | PTE_U | PTE_W) < 0){
-                panic("No memory to grow process %d stack (rip=%p)!\n",
-                    pid_, regs->reg_rip);
-            }
+        // system calls pin user pages (`swap_pin`), so the kernel never
+        // has to wait for swap while holding a spinlock
+        if (!(regs->reg_err & (PFERR_USER | PFERR_PRESENT))
+            && addr <= VA_LOWMAX
+            && this_cpu()->spinlock_depth_ != 0
+            && vmiter(this, addr).swapped()) {
+            panic("Kernel page fault for swapped-out %p (rip=%p)!\n",
+                  addr, regs->reg_rip);
+        }
+
+        // first touch of a demand-zero page? (this includes the stack,
+        // which grows on any fault above its guard gap)
+        if (!(regs->reg_err & PFERR_PRESENT)
+            && addr <= VA_LOWMAX
+            && vmregion_fill(pagetable_, addr, regs->reg_err & PFERR_WRITE)) {
+            break;
+        }
 
-            debug_printf("[%d] pagefault mapped extra page in process stack\n",
-                pid_);
+        // write to a copy-on-write page (also from the kernel, e.g. `read`
+        // into a user buffer)?
+        if ((regs->reg_err & (PFERR_PRESENT | PFERR_WRITE))
+                == (PFERR_PRESENT | PFERR_WRITE)
+            && addr <= VA_LOWMAX
+            && vmiter(this, addr).cow()) {
+            if (break_cow(this, addr) < 0) {
+                panic("No memory to copy page %p for process %d (rip=%p)!\n",
+                      addr, pid_, regs->reg_rip);
+            }
             break;
         }
 
@@ -583,6 +1024,11 @@ void proc::exception(regstate* regs) {
         keyboardstate::get().handle_interrupt();
         break;
 
+    case INT_IRQ + IRQ_SHOOTDOWN:
+        tlb_shootdown_handle();
+        lapicstate::get().ack();
+        break;
+
     default:
         if (sata_disk && regs->reg_intno == INT_IRQ + sata_disk->irq_) {
             sata_disk->handle_interrupt();
@@ -612,6 +1058,10 @@ void proc::exception(regstate* regs) {
 uintptr_t proc::syscall(regstate* regs) {
     assert(read_rbp() % 16 == 0);  // check stack alignment
 
+    // keep user memory resident while the kernel may touch it
+    x86_64_pagetable* pinned_pt = pagetable_;
+    swap_pin(pinned_pt);
+
     uintptr_t r = -1;
     switch (regs->reg_rax) {
 
@@ -620,7 +1070,8 @@ uintptr_t proc::syscall(regstate* regs) {
             console_clear();
         }
         kdisplay = regs->reg_rdi;
-        return 0;
+        r = 0;
+        break;
 
     case SYSCALL_PANIC:
         panic(NULL);
@@ -641,11 +1092,21 @@ uintptr_t proc::syscall(regstate* regs) {
             r = E_INVAL;
             break;
         }
-        x86_64_page* pg = kallocpage();
-        if (!pg || vmiter(this, addr).map(ka2pa(pg)) < 0) {
+        // unmapped pages are backed on first touch; addresses another
+        // region already promises (heap, stack, `mmap`...) are refused
+        vmiter it(this, addr);
+        if (!it.present()) {
+            r = vmregion_add(pagetable_, addr, addr + PAGESIZE,
+                             PTE_P | PTE_W | PTE_U, true);
+            break;
+        }
+        x86_64_page* pg = kallocpage_zeroed();
+        if (!pg || it.map(ka2pa(pg)) < 0) {
             r = E_NOMEM;
             break;
         }
+        tlbgather tlb(pagetable_);
+        tlb.add(addr, PAGESIZE);
         r = 0;
         break;
     }
@@ -667,6 +1128,7 @@ uintptr_t proc::syscall(regstate* regs) {
 
     case SYSCALL_EXIT: {
         int status = regs->reg_rdi;
+        swap_unpin(pinned_pt);
         process_exit(this, status);
         this->yield_noreturn();
     }
@@ -686,15 +1148,14 @@ uintptr_t proc::syscall(regstate* regs) {
     case SYSCALL_MAP_SCREEN: {
         uintptr_t addr = regs->reg_rdi;
 
-        int vm_r;
-        size_t off;
-        for (off = 0; off < SCREEN_MEMSIZE; off += PAGESIZE) {
-            vm_r = vmiter(this, addr + off).map(SCREEN_MEMBASE + off,
-                                                PTE_P|PTE_W|PTE_U);
-            assert(vm_r >= 0);
-        }
+        // write-combining, so frame copies reach the device in bursts
+        // rather than as uncached byte writes
+        size_t sz = ROUNDUP(SCREEN_MEMSIZE, PAGESIZE);
+        int vm_r = vmiter(this, addr).map_range(SCREEN_MEMBASE, sz,
+                                                PTE_P|PTE_W|PTE_U|PTE_WC);
+        assert(vm_r >= 0);
         debug_printf("[%d] sys_map_screen -> %p to ~%p\n",
-            pid_, addr, addr + off);
+            pid_, addr, addr + sz);
         r = 0;
         break;
     }
@@ -877,6 +1338,12 @@ uintptr_t proc::syscall(regstate* regs) {
         uintptr_t addr = regs->reg_rsi;
         size_t sz = regs->reg_rdx;
 
+        // back the buffer before taking locks, since that may block
+        if (sz && addr + sz <= VA_LOWEND && addr <= VA_HIGHMAX - sz) {
+            vmregion_prefault(pagetable_, addr, sz,
+                              regs->reg_rax == SYSCALL_READ);
+        }
+
         auto irqs = fdtable_->lock_.lock();
         // debug_printf("[%d] sys_%s on fd %d", pid_,
         //     regs->reg_rax == SYSCALL_READ ? "read" : "write", fd);
@@ -1005,7 +1472,8 @@ uintptr_t proc::syscall(regstate* regs) {
         assert(dirino);
         dirino->lock_read();
 
-        auto ino = fs.lookup_inode(dirino, path);
+        auto ino_num = fs.lookup_inum(dirino, path);
+        auto ino = fs.get_inode(ino_num);
 
         dirino->unlock_read();
 
@@ -1013,7 +1481,7 @@ uintptr_t proc::syscall(regstate* regs) {
             if (flags & OF_CREATE && flags & OF_WRITE) {
                 // create new empty file with name
                 // allocate an inode
-                size_t ino_num = fs.find_empty_inode();
+                ino_num = fs.find_empty_inode();
                 ino = fs.get_inode(ino_num);
                 assert(ino);
                 ino->lock_write();
@@ -1059,7 +1527,7 @@ uintptr_t proc::syscall(regstate* regs) {
         }
 
         file* f = knew<file>();
-        vnode* v = knew<vnode_inode>(ino);
+        vnode* v = knew<vnode_inode>(ino, ino_num);
         if (!f || !v || fd == -1) {
             fdtable_->lock_.unlock(irqs);
             fs.put_inode(ino);
@@ -1083,6 +1551,7 @@ uintptr_t proc::syscall(regstate* regs) {
             f->lock_.unlock(irqs);
             ino->lock_write();
             ino->size = 0;
+            textcache_invalidate(ino_num);
             ino->unlock_write();
         }
 
@@ -1154,8 +1623,7 @@ uintptr_t proc::syscall(regstate* regs) {
         auto argv = reinterpret_cast<const char* const*>(regs->reg_rsi);
         size_t argc = regs->reg_rdx;
 
-        auto name_sz =
-            check_string_termination(program_name, memfile::namesize);
+        int name_sz = exec_check(program_name, argv, argc);
         if (name_sz < 0) {
             r = name_sz;
             break;
@@ -1164,142 +1632,44 @@ uintptr_t proc::syscall(regstate* regs) {
         debug_printf("[%d] sys_execv '%s' argc = %d\n",
             pid_, program_name, argc);
 
-        // validate args
-        if (argc < 1) {
-            r = E_INVAL;
-            break;
-        } else if (!validate_memory(argv, (argc + 1) * 8, PTE_P | PTE_U)) {
-            r = E_FAULT;
-            break;
-        } else if (!argv[0]) {  // need a real string in pos 0
-            r = E_INVAL;
-            break;
-        }
-        for(unsigned i = 0; i < argc + 1; i++) {
-            // make sure argv is null-terminated
-            if (i == argc) {
-                if (argv[i] != nullptr) {
-                    r = E_INVAL;
-                    break;
-                }
-            } else {
-                int r_cst =
-                    check_string_termination(argv[i], memfile::namesize);
-                if (r_cst < 0) {
-                    r = r_cst;
-                    break;
-                }
-            }
-        }
-
-
-        // allocate all the memory
-        auto npt = kalloc_pagetable();
-        auto stkpg = kallocpage();
-        if (!npt || !stkpg) {
-            kdelete(npt);
-            kdelete(stkpg);
-            r = E_NOMEM;
-            break;
-        }
-
-
-        // load program
-        disk_loader dl;
-        dl.pagetable_ = npt;
-        memcpy(dl.name_, program_name, name_sz);
-        auto load_r = load(dl);
+        exec_image img;
+        int load_r = exec_load(program_name, name_sz, argv, argc, img);
         if (load_r < 0) {
             r = load_r;
             debug_printf("[%d] exec load failed, r = %d\n", pid_, load_r);
             break;
         }
 
-
-        // get the total length of the argv array
-        size_t argv_len = 0;
-        for (size_t i = 0; i < argc; i++) {
-            argv_len += strlen(argv[i]) + 1;
-        }
-
-        // get the amount of memory for the ptrs to strings
-        size_t sz_argv_ptrs = 8 * (argc + 1);
-
-        // 8-byte align argv_len
-        size_t mem_diff = argv_len;
-        if (argv_len % 8 != 0) {
-            mem_diff = ((argv_len / 8) + 1) * 8;
-        }
-        mem_diff += sz_argv_ptrs;
-
-        // copy each string to the top of the stack page
-        auto stkpg_top = reinterpret_cast<uintptr_t>(stkpg) + PAGESIZE;
-        size_t arg_len = 0;
-        for (size_t i = 0; i < argc; i++) {
-            // copy string to stack page
-            memcpy(reinterpret_cast<void*>(
-                    stkpg_top - mem_diff + sz_argv_ptrs + arg_len),
-                argv[i], strlen(argv[i]) + 1);
-
-            // copy pointer to string to stack page
-            uintptr_t argv_ptr =
-                MEMSIZE_VIRTUAL - mem_diff + sz_argv_ptrs + arg_len;
-            memcpy(reinterpret_cast<void*>(stkpg_top - mem_diff + 8 * i),
-                &argv_ptr, 8);
-
-            // update program_name to point into the new pagetable
-            if (i == 0) {
-                program_name = reinterpret_cast<const char*>(argv_ptr);
-            }
-
-            arg_len += strlen(argv[i]) + 1;
-        }
-        // null-terminate argv pointer array
-        *reinterpret_cast<void**>(stkpg_top - mem_diff + sz_argv_ptrs - 8) =
-            nullptr;
-
         // save things clobbered by init_user
         auto old_pt = pagetable_;
-        auto old_regs = *regs;
         auto old_yields = yields_;
 
         // set up regs_ and pagetable_
-        init_user(pid_, npt);
+        init_user(pid_, img.pagetable_);
         yields_ = old_yields;
 
         regs_ = regs;
-
-        // align stack by 16 bytes
-        regs_->reg_rsp = MEMSIZE_VIRTUAL - 8;
-
-        // map stackpage and console into vm
-        assert(vmiter(this, MEMSIZE_VIRTUAL - PAGESIZE).map(ka2pa(stkpg),
-                                                PTE_P | PTE_W | PTE_U) >= 0);
-        assert(vmiter(this, ktext2pa(console)).map(ktext2pa(console),
-                                                PTE_P | PTE_W | PTE_U) >= 0);
+        img.start(regs_);
 
         set_pagetable(pagetable_);
 
-        // set program entry point
-        regs_->reg_rip = dl.entry_rip_;
-
-        // set 1st argument to argc
-        regs_->reg_rdi = argc;
-
-        // set 2nd argument to argv pointer
-        regs_->reg_rsi =
-            reinterpret_cast<uintptr_t>(MEMSIZE_VIRTUAL - mem_diff);
-
-        // set rsp to bottom of argv data
-        uintptr_t below_argv = MEMSIZE_VIRTUAL - mem_diff - 8;
-        if (below_argv % 16 != 0) below_argv = ((below_argv / 16) - 1) * 16;
-        regs_->reg_rsp = regs_->reg_rbp = below_argv;
-
+        swap_unpin(old_pt);
         nuke_pagetable(old_pt);
 
         yield_noreturn();
     }
 
+    case SYSCALL_SPAWN: {
+        auto program_name = reinterpret_cast<const char*>(regs->reg_rdi);
+        auto argv = reinterpret_cast<const char* const*>(regs->reg_rsi);
+        size_t argc = regs->reg_rdx;
+        auto actions = reinterpret_cast<const spawn_fdaction*>(regs->reg_r10);
+        size_t nactions = regs->reg_r8;
+
+        r = process_spawn(this, program_name, argv, argc, actions, nactions);
+        break;
+    }
+
     case SYSCALL_READDISKFILE: {
         const char* filename = reinterpret_cast<const char*>(regs->reg_rdi);
         unsigned char* buf = reinterpret_cast<unsigned char*>(regs->reg_rsi);
@@ -1307,10 +1677,16 @@ uintptr_t proc::syscall(regstate* regs) {
         uintptr_t off = regs->reg_r10;
 
         if (!sata_disk) {
-            return E_IO;
+            r = E_IO;
+            break;
+        }
+        if (!validate_memory(buf, sz, PTE_P | PTE_W | PTE_U)) {
+            r = E_FAULT;
+            break;
         }
 
-        return chickadeefs_read_file_data(filename, buf, sz, off);
+        r = chickadeefs_read_file_data(filename, buf, sz, off);
+        break;
     }
 
     case SYSCALL_SYNC: {
@@ -1318,6 +1694,16 @@ uintptr_t proc::syscall(regstate* regs) {
         break;
     }
 
+    case SYSCALL_KALLOC_DUMP: {
+#if KALLOC_TRACK
+        kalloc_dump();
+        r = 0;
+#else
+        r = E_NOSYS;
+#endif
+        break;
+    }
+
     case SYSCALL_LSEEK: {
         int fd = regs->reg_rdi;
         ssize_t off = regs->reg_rsi;
@@ -1390,7 +1776,7 @@ uintptr_t proc::syscall(regstate* regs) {
         new_p->pid_ = get_proc_slot(ptable);
         if (new_p->pid_ < 0) {
             ptable_lock.unlock(irqs);
-            kfree(new_p);
+            kfree_proc(new_p);
             r = -1; // TODO
             break;
         }
@@ -1424,6 +1810,7 @@ uintptr_t proc::syscall(regstate* regs) {
         int status = regs->reg_rdi;
         debug_printf("[%d] sys_texit %d active threads\n",
             pid_, active_threads(this));
+        swap_unpin(pinned_pt);
 
         if (active_threads(this) == 1) {
             process_exit(this, status);
@@ -1439,34 +1826,23 @@ uintptr_t proc::syscall(regstate* regs) {
 
     case SYSCALL_MALLOC: {
         size_t size = regs->reg_rdi;
-        if (size > (1U << 24)) { // 21 = MAX_ORDER from k-alloc.cc
-            log_printf("WARNING: sys_malloc call exceeds maximum size\n");
-        }
-        if (size) {
-            // log_printf("[%d] sys_malloc %zu -> proc mem @ 0x%x\n",
-            //     pid_, size, this->malloc_top_);
-        } else {
+        if (!size) {
             log_printf("WARNING: sys_malloc of size 0 -> nullptr\n");
             r = reinterpret_cast<uintptr_t>(nullptr);
             break;
         }
 
-        auto kaddr = kalloc(size);
-        if (!kaddr) {
+        // the region is backed on first touch; a large region starts on a
+        // 2MiB boundary so written chunks can use 2MiB pages
+        intptr_t addr = size > VA_LOWEND ? E_NOMEM
+            : vmregion_map(pagetable_, ROUNDUP(size, PAGESIZE),
+                           PTE_P|PTE_W|PTE_U);
+        if (addr < 0) {
             log_printf("WARNING: sys_malloc failed, probably out of memory\n");
             r = reinterpret_cast<uintptr_t>(nullptr);
             break;
         }
-
-        int vm_r;
-        for (unsigned off = 0; off < size; off += PAGESIZE) {
-            vm_r = vmiter(this, this->malloc_top_ + off).map(
-                            this->malloc_top_ + off, PTE_P|PTE_W|PTE_U);
-            assert(vm_r >= 0);
-        }
-
-        r = this->malloc_top_;
-        this->malloc_top_ = ROUNDUP(this->malloc_top_ + size + 64, PAGESIZE);
+        r = addr;
         break;
     }
 
@@ -1477,10 +1853,114 @@ uintptr_t proc::syscall(regstate* regs) {
             break;
         }
 
-        auto ka = vmiter(this, ptr).ka();
-        // log_printf("[%d] sys_free %p -> ka %d\n", pid_, ptr, ka);
-        kfree(ka);
-        r = 0;
+        // log_printf("[%d] sys_free %p\n", pid_, ptr);
+        // unmaps and frees whatever part of the region was touched
+        r = vmregion_free(pagetable_, ptr);
+        break;
+    }
+
+    case SYSCALL_MMAP: {
+        int fd = regs->reg_rdi;
+        size_t off = regs->reg_rsi;
+        size_t len = regs->reg_rdx;
+        int prot = regs->reg_r10;
+        int flags = regs->reg_r8 & ~MAP_ANONYMOUS;
+        bool anon = regs->reg_r8 & MAP_ANONYMOUS;
+        if (len == 0 || off % PAGESIZE != 0
+            || !(prot & PROT_READ)
+            || (flags != MAP_SHARED && flags != MAP_PRIVATE)) {
+            r = E_INVAL;
+            break;
+        }
+        size_t sz = ROUNDUP(len, PAGESIZE);
+        int perm = PTE_P | PTE_U | (prot & PROT_WRITE ? PTE_W : 0);
+        if (sz < len) {
+            r = E_NOMEM;
+            break;
+        }
+
+        // anonymous memory is zeroed on first touch; shared anonymous
+        // memory is a private shared memory segment, which children
+        // inherit
+        if (anon && flags == MAP_PRIVATE) {
+            r = vmregion_map(pagetable_, sz, perm);
+            break;
+        } else if (anon) {
+            int id = shm_get(0, sz);
+            if (id < 0) {
+                r = id;
+            } else if (shm_attach(id) < 0) {
+                r = E_INVAL;
+            } else {
+                r = vmregion_map_shm(pagetable_, sz, perm, id);
+            }
+            break;
+        }
+
+        auto irqs = fdtable_->lock_.lock();
+        int fd_r = validate_fd(fd, fdtable_);
+        if (fd_r < 0) {
+            fdtable_->lock_.unlock(irqs);
+            r = fd_r;
+            break;
+        }
+        auto f = fdtable_->fds_[fd];
+        unsigned inum = f->type_ == file::normie ? f->vnode_->inum() : 0;
+        bool readable = f->readable_;
+        bool writeable = f->writeable_;
+        fdtable_->lock_.unlock(irqs);
+
+        // only disk files can be mapped; shared writes need a writable fd
+        if (!inum) {
+            r = E_INVAL;
+            break;
+        } else if (!readable
+                   || (flags == MAP_SHARED && (prot & PROT_WRITE)
+                       && !writeable)) {
+            r = E_PERM;
+            break;
+        }
+
+        r = vmregion_map_file(pagetable_, sz, perm, inum, off,
+                              flags == MAP_SHARED);
+        break;
+    }
+
+    case SYSCALL_SHMGET: {
+        r = shm_get(regs->reg_rdi, regs->reg_rsi);
+        break;
+    }
+
+    case SYSCALL_SHMAT: {
+        int id = regs->reg_rdi;
+        ssize_t sz = shm_attach(id);
+        if (sz < 0) {
+            r = sz;
+            break;
+        }
+        // the region owns the attachment from here on
+        r = vmregion_map_shm(pagetable_, sz, PTE_P | PTE_W | PTE_U, id);
+        break;
+    }
+
+    case SYSCALL_SHMDT: {
+        r = vmregion_free(pagetable_, regs->reg_rdi);
+        break;
+    }
+
+    case SYSCALL_BRK: {
+        r = vmregion_brk(pagetable_, regs->reg_rdi);
+        break;
+    }
+
+    case SYSCALL_MUNMAP: {
+        uintptr_t addr = regs->reg_rdi;
+        size_t len = regs->reg_rsi;
+        if (len == 0) {
+            r = E_INVAL;
+            break;
+        }
+        r = vmregion_free(pagetable_, addr, len);
         break;
     }
 
@@ -1504,6 +1984,7 @@ uintptr_t proc::syscall(regstate* regs) {
         r = E_NOSYS;
     }
 
+    swap_unpin(pinned_pt);
     check_corruption(this);
     return r;
 }
@@ -53,7 +53,6 @@ struct __attribute__((aligned(4096))) proc {
 
     fdtable* fdtable_;
 
-    size_t malloc_top_;                 // dirty hack for malloc
 
     int canary_;
 
@@ -71,6 +70,9 @@ struct __attribute__((aligned(4096))) proc {
         uintptr_t entry_rip_ = 0;
         virtual ssize_t get_page(uint8_t** pg, size_t off) = 0;
         virtual void put_page(uint8_t* pg) = 0;
+        // disk inode of the binary, whose read-only segments can then
+        // map shared text pages; 0 if none
+        virtual unsigned text_inum() { return 0; }
     };
     static int load(loader& ld);
     int load(const char* binary_name);
@@ -106,9 +108,14 @@ extern int canary_value;
 
 // allocate a new `proc` and call its constructor
 proc* kalloc_proc() __attribute__((malloc));
+// free a `proc` from `kalloc_proc`, keeping it for reuse if possible
+void kfree_proc(proc* p);
 
 const char* state_string(const proc* p);
 
+// page tables each CPU keeps tagged translations for, when PCIDs work
+#define NPCID 8
+
 // CPU state type
 struct __attribute__((aligned(4096))) cpustate {
     // These three members must come first:
@@ -126,6 +133,25 @@ struct __attribute__((aligned(4096))) cpustate {
 
     unsigned spinlock_depth_;
 
+    x86_64_page* page_magazine_;        // per-CPU free pages (k-alloc.cc)
+    unsigned npage_magazine_;
+    list<proc, &proc::runq_link_> proc_pool_;  // free `proc`s (k-proc.cc)
+    unsigned nproc_pool_;
+
+    // TLB tagging (k-hardware.cc): with PCIDs, PCID `i` holds translations
+    // for `pcid_pagetable_[i]` that are valid if `pcid_gen_[i]` is current
+    bool pcid_;
+    x86_64_pagetable* pcid_pagetable_[NPCID];
+    unsigned long pcid_gen_[NPCID];
+    unsigned pcid_next_;                // next PCID to reassign
+    std::atomic<x86_64_pagetable*> loaded_pagetable_;
+
+    // TLB shootdown request from another CPU (k-tlb.cc)
+    std::atomic<bool> tlb_pending_;
+    x86_64_pagetable* tlb_pt_;
+    uintptr_t tlb_start_;
+    uintptr_t tlb_end_;
+
     uint64_t gdt_segments_[7];
     x86_64_taskstate task_descriptor_;
 
@@ -193,10 +219,17 @@ extern volatile unsigned long ticks;     // number of ticks since boot
 #define SEGSEL_TASKSTATE        0x28            // task state segment
 
 
-// Physical memory size (75 MB - about 2 MB used by kernel)
-#define MEMSIZE_PHYSICAL        (30 * 1024 * 1024)
-// Virtual memory size
-#define MEMSIZE_VIRTUAL         MEMSIZE_PHYSICAL
+// Physical memory size: one past the highest usable physical address.
+// Detected at boot by `init_physical_ranges`.
+extern uintptr_t memsize_physical;
+// Physical memory size assumed if detection fails
+#define MEMSIZE_PHYSICAL_DEFAULT (30 * 1024 * 1024)
+// Limit of physical addresses the kernel tracks (the high mapping covers
+// this much)
+#define MEMSIZE_PHYSICAL_LIMIT  0x8000000000UL
+// Virtual memory size (user stacks start here); independent of
+// physical memory
+#define MEMSIZE_VIRTUAL         (30 * 1024 * 1024)
 
 enum memtype_t {
     mem_nonexistent = 0, mem_available = 1, mem_kernel = 2, mem_reserved = 3,
@@ -211,6 +244,7 @@ extern memrangeset<16> physical_ranges;
 #define IRQ_KEYBOARD            1
 #define IRQ_IDE                 14
 #define IRQ_ERROR               19
+#define IRQ_SHOOTDOWN           20      // TLB shootdown IPI
 #define IRQ_SPURIOUS            31
 
 #define KTEXT_BASE              0xFFFFFFFF80000000UL
@@ -307,25 +341,212 @@ inline T read_unaligned_pa(uint64_t pa) {
 
 // kallocpage
 //    Allocate and return a page. Returns `nullptr` on failure.
-//    Returns a high canonical address.
+//    Returns a high canonical address. The page may contain stale data;
+//    use `kallocpage_zeroed` if it must be zero.
 x86_64_page* kallocpage() __attribute__((malloc));
+x86_64_page* kallocpage_zeroed() __attribute__((malloc));
 
 // kalloc(sz)
 //    Allocate and return a pointer to at least `sz` contiguous bytes
-//    of memory. Returns `nullptr` if `sz == 0` or on failure.
+//    of memory. Returns `nullptr` if `sz == 0` or on failure. Freed
+//    memory is not cleared, so the block may contain stale data.
 void* kalloc(size_t sz) __attribute__((malloc));
 
+// kalloc_zeroed(sz)
+//    Like `kalloc`, but the returned memory is zeroed.
+void* kalloc_zeroed(size_t sz) __attribute__((malloc));
+
+// kalloc_prezero()
+//    Zero some free memory ahead of time. Returns false if there was
+//    nothing to do. Called by idle tasks.
+bool kalloc_prezero();
+
+// shrinker
+//    A kernel cache that can give memory back under memory pressure.
+//    `shrink_(npages)` should free up to `npages` pages the cache can do
+//    without and return the number freed. It is called from `kalloc`, so
+//    it must not block, and it must only `trylock` locks that an
+//    allocating caller might hold.
+struct shrinker {
+    size_t (*shrink_)(size_t npages);
+    shrinker* next_;
+};
+
+// register_shrinker(s)
+//    Add `s` to the shrinkers run by `kalloc` before it fails and by the
+//    background reclaim task when free memory runs low.
+void register_shrinker(shrinker* s);
+
+// run_shrinkers(want)
+//    Ask shrinkers to free about `want` pages. Returns pages freed.
+size_t run_shrinkers(size_t want);
+
+// start the background reclaim task
+void init_reclaim();
+
+#if KALLOC_TRACK
+// kalloc_dump()
+//    Log live allocations by call site and by process. Only available
+//    when built with `make KALLOC_TRACK=1`.
+void kalloc_dump();
+#endif
+
 // kfree(ptr)
-//    Free a pointer previously returned by `kalloc`, `kallocpage`, or
-//    `kalloc_pagetable`. Does nothing if `ptr == nullptr`.
+//    Free a pointer previously returned by `kalloc`, `kallocpage`,
+//    `kalloc_slab`, or `kalloc_pagetable`. Does nothing if `ptr == nullptr`.
 void kfree(void* ptr);
 
+// kfree_batch(ptrs, n)
+//    Free `n` pointers as if by `kfree`, more cheaply than one at a time.
+void kfree_batch(void* const* ptrs, size_t n);
+
+// kalloc_size(ptr)
+//    Return the size of the page block `ptr` returned by `kalloc`, or 0
+//    if `ptr` is not the start of an allocated block (e.g., it is device
+//    or kernel image memory).
+size_t kalloc_size(void* ptr);
+
+// kalloc_split(ptr)
+//    Split the allocated block at `ptr` into pages that can be freed
+//    one at a time, e.g. after part of a 2MiB mapping is unmapped.
+void kalloc_split(void* ptr);
+
+// kalloc_ref(ptr), kalloc_shared(ptr)
+//    Add a reference to the allocated block at `ptr`, or test whether it
+//    has more than one. Each reference is dropped by its own `kfree`.
+void kalloc_ref(void* ptr);
+bool kalloc_shared(void* ptr);
+
+// software PTE bits: read-only page shared copy-on-write after `fork`;
+// writable page of a shared file mapping, which `fork` keeps shared
+#define PTE_COW 0x200UL
+#define PTE_SHARED 0x400UL
+
+// in a non-present PTE: the page is in swap slot `pte >> PAGEOFFBITS`,
+// and `pte & (PTE_W | PTE_U)` are its permissions (k-swap.cc)
+#define PTE_SWAP 0x800UL
+
+// write-combining memory type for device memory such as the framebuffer:
+// `init_cpu_hardware` programs the PAT so that PWT alone selects WC
+#define PTE_WC PTE_PWT
+
+// demand-zero regions (k-vmregion.cc)
+//    Ranges of user memory promised to a page table but only backed, with
+//    zeroed pages or pages of a disk file, when first touched. The
+//    `vmregion_map` functions choose the address themselves, at or above
+//    `VMREGION_BASE`.
+#define VMREGION_BASE 0x4000000UL
+// user stacks end at `MEMSIZE_VIRTUAL` and grow down to at most
+// `STACK_SIZE_MAX` bytes; below that is a never-backed guard gap. The
+// whole range is one region, so `sys_page_alloc` refuses it.
+// Growing the stack backs up to `STACK_PREFETCH_MAX` pages per fault.
+#define STACK_SIZE_MAX (8UL << 20)
+#define STACK_GUARD (16 * PAGESIZE)
+#define STACK_PREFETCH_MAX 16
+int vmregion_add(x86_64_pagetable* pt, uintptr_t start, uintptr_t end,
+                 int perm, bool mergeable = false);
+int vmregion_add_file(x86_64_pagetable* pt, uintptr_t start, uintptr_t end,
+                      int perm, unsigned inum, size_t off, bool shared);
+intptr_t vmregion_map(x86_64_pagetable* pt, size_t sz, int perm);
+intptr_t vmregion_map_file(x86_64_pagetable* pt, size_t sz, int perm,
+                           unsigned inum, size_t off, bool shared);
+intptr_t vmregion_map_shm(x86_64_pagetable* pt, size_t sz, int perm,
+                          int id);
+int vmregion_add_heap(x86_64_pagetable* pt, uintptr_t base);
+int vmregion_add_stack(x86_64_pagetable* pt, uintptr_t top, size_t size);
+intptr_t vmregion_brk(x86_64_pagetable* pt, uintptr_t addr);
+bool vmregion_fill(x86_64_pagetable* pt, uintptr_t va, bool write);
+void vmregion_prefault(x86_64_pagetable* pt, uintptr_t addr, size_t sz,
+                       bool write);
+int vmregion_copy(x86_64_pagetable* from, x86_64_pagetable* to);
+int vmregion_free(x86_64_pagetable* pt, uintptr_t start, size_t sz = 0);
+void vmregion_clear(x86_64_pagetable* pt);
+size_t vmregion_swap_out(size_t want);
+
+// the shared zero page that backs reads of untouched demand-zero memory
+extern x86_64_page* zero_page;
+
+// shared text pages (k-textcache.cc)
+//    Refcounted pages of files on disk, keyed by inode number and file
+//    offset, that back read-only segments of every process running that
+//    program and every `mmap` of that file.
+x86_64_page* textcache_get(unsigned inum, size_t off);
+void textcache_invalidate(unsigned inum);
+
+// swap (k-swap.cc)
+//    Anonymous pages evicted to the file system's swap area under memory
+//    pressure, and read back on the next fault.
+bool swap_init();
+intptr_t swap_alloc();
+void swap_ref(size_t slot);
+void swap_free(size_t slot);
+void swap_pin(x86_64_pagetable* pt);
+void swap_unpin(x86_64_pagetable* pt);
+int swap_out_page(x86_64_pagetable* pt, uintptr_t va);
+bool swap_in(x86_64_pagetable* pt, uintptr_t va);
+
+// cow_lock
+//    Serializes changes to the copy-on-write and swap state of user
+//    mappings (kernel.cc).
+extern spinlock cow_lock;
+
+// shared memory segments (k-shm.cc)
+//    Refcounted sets of pages that processes attach with `sys_shmat`.
+int shm_get(int key, size_t sz);
+ssize_t shm_attach(int id);
+void shm_detach(int id);
+x86_64_page* shm_page(int id, size_t i);
+
+// slab caches
+//    Objects of at most `1 << SLAB_MAXORDER` bytes are packed into pages
+//    by power-of-two size class instead of each taking a buddy block.
+#define SLAB_MINORDER 5
+#define SLAB_MAXORDER 10
+#define NSLABCLASSES (SLAB_MAXORDER - SLAB_MINORDER + 1)
+
+// slab_class(sz, align)
+//    Return the slab size class for objects with size `sz` and alignment
+//    `align`, or -1 if they should come from the buddy allocator.
+constexpr int slab_class(size_t sz, size_t align) {
+    if (sz > (1UL << SLAB_MAXORDER) || align > 16) {
+        return -1;
+    }
+    int order = SLAB_MINORDER;
+    while ((1UL << order) < sz) {
+        ++order;
+    }
+    return order - SLAB_MINORDER;
+}
+
+// kalloc_slab(sc)
+//    Allocate a zeroed object from slab size class `sc`. Returns
+//    `nullptr` on failure. Free with `kfree`.
+void* kalloc_slab(int sc) __attribute__((malloc));
+
+// kfree_slab(ptr)
+//    Free an object returned by `kalloc_slab`. `kfree` calls this for
+//    pointers that are not page-aligned.
+void kfree_slab(void* ptr);
+
+// kalloc_object<T>()
+//    Allocate memory for an object of type `T`, choosing a slab cache at
+//    compile time when `T` is small enough.
+template <typename T>
+inline void* kalloc_object() {
+    constexpr int sc = slab_class(sizeof(T), alignof(T));
+    if constexpr (sc >= 0) {
+        return kalloc_slab(sc);
+    } else {
+        return kalloc_zeroed(sizeof(T));
+    }
+}
+
 // knew<T>()
 //    Return a pointer to a newly-allocated object of type `T`. Calls
 //    the new object's constructor. Returns `nullptr` on failure.
 template <typename T>
 inline T* knew() {
-    if (void* mem = kalloc(sizeof(T))) {
+    if (void* mem = kalloc_object<T>()) {
         return new (mem) T;
     } else {
         return nullptr;
@@ -333,7 +554,7 @@ inline T* knew() {
 }
 template <typename T, typename... Args>
 inline T* knew(Args&&... args) {
-    if (void* mem = kalloc(sizeof(T))) {
+    if (void* mem = kalloc_object<T>()) {
         return new (mem) T(std::forward<Args>(args)...);
     } else {
         return nullptr;
@@ -354,10 +575,10 @@ void kdelete(T* obj) {
 //    Expressions like `new (std::nothrow) T(...)` and `delete x` work,
 //    and call kalloc/kfree.
 inline void* operator new(size_t sz, const std::nothrow_t&) noexcept {
-    return kalloc(sz);
+    return kalloc_zeroed(sz);
 }
 inline void* operator new[](size_t sz, const std::nothrow_t&) noexcept {
-    return kalloc(sz);
+    return kalloc_zeroed(sz);
 }
 inline void operator delete(void* ptr) noexcept {
     kfree(ptr);
@@ -380,6 +601,13 @@ void init_kalloc();
 // run unit tests on the kalloc system
 void test_kalloc();
 
+// initialize slab caches and run their unit tests
+void init_slab();
+void test_slab();
+
+// log slab cache usage
+void print_slab_stats();
+
 
 // initialize hardware and CPUs
 void init_hardware();
@@ -401,6 +629,50 @@ x86_64_pagetable* kalloc_pagetable();
 // change current page table
 void set_pagetable(x86_64_pagetable* pagetable);
 
+// make CPUs drop cached translations at their next page table switch
+void invalidate_pagetables();
+
+
+// tlbgather: a batch of changes to a live page table (k-tlb.cc)
+//    Collects the addresses whose mappings changed and the pages they
+//    mapped, then, in `flush()`, invalidates those addresses on every CPU
+//    that has the page table loaded (with at most one IPI per CPU) and
+//    frees the pages. Pages must not be reused before other CPUs stop
+//    using them. Flushes on destruction. Must not be flushed while
+//    holding a spinlock that another CPU might wait for with interrupts
+//    disabled.
+
+#define TLBGATHER_NPAGES 32
+#define TLB_FLUSH_THRESHOLD 32      // invalidate larger ranges by flushing
+
+class vmiter;
+
+struct tlbgather {
+    explicit tlbgather(x86_64_pagetable* pt);
+    ~tlbgather();
+    NO_COPY_OR_ASSIGN(tlbgather);
+
+    // note that mappings in [va, va + sz) changed
+    void add(uintptr_t va, size_t sz);
+    // free page `ka` once no CPU can reach it
+    void free(void* ka);
+    // clear `it`'s mapping and free its page once no CPU can reach it;
+    // like `it.kfree_page()`
+    void free_page(vmiter& it);
+
+    void flush();
+
+  private:
+    x86_64_pagetable* pt_;
+    uintptr_t start_;
+    uintptr_t end_;
+    unsigned npages_;
+    void* pages_[TLBGATHER_NPAGES];
+};
+
+// handle a TLB shootdown request from another CPU
+void tlb_shootdown_handle();
+
 
 // turn off the virtual machine
 void poweroff() __attribute__((noreturn));
@@ -434,6 +706,10 @@ void debug_printf_(const char* file, const char* func, int line,
 //    Print a backtrace to the host's `log.txt` file.
 void log_backtrace(const char* prefix = "");
 
+// lookup_symbol(addr, name, start)
+//    Look up the kernel symbol containing `addr`. Returns false if none.
+bool lookup_symbol(uintptr_t addr, const char** name, uintptr_t* start);
+
 
 #if HAVE_SANITIZERS
 // sanitizer functions
@@ -531,13 +807,15 @@ inline void proc::unlock_pagetable_read(irqstate&) {
 }
 
 struct disk_loader : public proc::loader {
-    disk_loader() : name_("") { };
+    disk_loader() : name_(""), inum_(0) { };
 
     static constexpr unsigned namesize = 64;
     char name_[namesize];
+    unsigned inum_;             // looked up on first use
 
     ssize_t get_page(uint8_t** pg, size_t off) override;
     void put_page(uint8_t* pg) override;
+    unsigned text_inum() override;
 };
 
 #endif
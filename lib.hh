@@ -204,6 +204,14 @@ inline uint32_t crc32c(const void* buf, size_t sz) {
 #define SYSCALL_GETTID          114
 #define SYSCALL_CLONE           115
 #define SYSCALL_TEXIT           116
+#define SYSCALL_KALLOC_DUMP     117
+#define SYSCALL_MMAP            118
+#define SYSCALL_MUNMAP          119
+#define SYSCALL_SHMGET          120
+#define SYSCALL_SHMAT           121
+#define SYSCALL_SHMDT           122
+#define SYSCALL_BRK             123
+#define SYSCALL_SPAWN           124
 // DOOM specific calls
 #define SYSCALL_MALLOC          90
 #define SYSCALL_SWAPCOLOR       91
@@ -258,6 +266,23 @@ inline bool is_error(uintptr_t r) {
 #define OF_CREAT                OF_CREATE     // ¯\_(ツ)_/¯
 #define OF_TRUNC                8
 
+// sys_mmap() protections and flags
+#define PROT_READ               1
+#define PROT_WRITE              2
+#define MAP_SHARED              1    // writes reach the file
+#define MAP_PRIVATE             2    // writes go to private copies
+#define MAP_ANONYMOUS           4    // zeroed memory, not a file
+
+// sys_spawn() file actions, applied in order to the child's copy of the
+// parent's file descriptors
+#define SPAWN_DUP2              1    // make `newfd` a copy of `fd`
+#define SPAWN_CLOSE             2    // close `fd`
+struct spawn_fdaction {
+    int op;
+    int fd;
+    int newfd;
+};
+
 // sys_lseek() origins
 #define LSEEK_SET               0    // Seek from beginning of file
 #define LSEEK_CUR               1    // Seek from current position
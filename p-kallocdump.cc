@@ -0,0 +1,16 @@
+#include "p-lib.hh"
+
+// kallocdump: log live kernel allocations by call site and by process.
+// Needs a kernel built with `make KALLOC_TRACK=1`.
+
+void process_main(int argc, char** argv) {
+    sys_kdisplay(KDISPLAY_NONE);
+
+    int r = sys_kalloc_dump();
+    if (r == E_NOSYS) {
+        const char msg[] = "kallocdump: kernel built without KALLOC_TRACK\n";
+        sys_write(2, msg, sizeof(msg) - 1);
+        sys_exit(1);
+    }
+    sys_exit(0);
+}
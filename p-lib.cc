@@ -1,4 +1,5 @@
 #include "p-lib.hh"
+#include <atomic>
 
 // dprintf
 //    Construct a string from `format` and pass it to `sys_write(fd)`.
@@ -123,3 +124,148 @@ int atoi(const char *str)
     // Return result with sign
     return sign*res;
 }
+
+
+// malloc, free, realloc
+//    Small blocks (up to `MALLOC_MAXSMALL` bytes) are rounded up to a
+//    power-of-two size class and recycled through one free list per
+//    class; they are carved from `MALLOC_CHUNKSIZE` chunks of anonymous
+//    memory, which the kernel backs only as they are touched. Larger
+//    blocks get their own anonymous mapping, which `free` returns to the
+//    kernel. Every block starts with a header holding its usable size
+//    and the size last requested for it, which is all `realloc` copies.
+//    `malloc_lock` makes this safe for `sys_clone` threads.
+
+#define MALLOC_ALIGN 16
+#define MALLOC_NCLASSES 8               // 16, 32, ..., 2048 bytes
+#define MALLOC_MAXSMALL (MALLOC_ALIGN << (MALLOC_NCLASSES - 1))
+#define MALLOC_CHUNKSIZE (256 << 10)
+
+struct mblock {
+    size_t size_;                       // usable bytes after the header
+    size_t used_;                       // bytes requested (<= `size_`)
+};
+struct mfree {
+    mfree* next_;
+};
+
+static std::atomic_flag malloc_lock = ATOMIC_FLAG_INIT;
+static mfree* malloc_free[MALLOC_NCLASSES];
+static uintptr_t malloc_chunk;          // next unused byte of the chunk
+static uintptr_t malloc_chunk_end;
+
+static void malloc_acquire() {
+    while (malloc_lock.test_and_set(std::memory_order_acquire)) {
+        sys_yield();
+    }
+}
+
+static void malloc_release() {
+    malloc_lock.clear(std::memory_order_release);
+}
+
+static void* malloc_map(size_t sz) {
+    void* p = sys_mmap(-1, 0, sz, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS);
+    return is_error(reinterpret_cast<uintptr_t>(p)) ? nullptr : p;
+}
+
+static char* malloc_large(size_t size) {
+    if (size > SIZE_MAX - PAGESIZE - sizeof(mblock)) {
+        return nullptr;
+    }
+    size_t sz = ROUNDUP(size + sizeof(mblock), PAGESIZE);
+    mblock* b = reinterpret_cast<mblock*>(malloc_map(sz));
+    if (!b) {
+        return nullptr;
+    }
+    b->size_ = sz - sizeof(mblock);
+    b->used_ = size;
+    return reinterpret_cast<char*>(b + 1);
+}
+
+char* malloc(size_t size) {
+    if (size == 0) {
+        return nullptr;
+    } else if (size > MALLOC_MAXSMALL) {
+        return malloc_large(size);
+    }
+
+    int c = 0;
+    while ((size_t(MALLOC_ALIGN) << c) < size) {
+        ++c;
+    }
+    size_t csize = MALLOC_ALIGN << c;
+
+    malloc_acquire();
+    mblock* b;
+    if (mfree* f = malloc_free[c]) {
+        malloc_free[c] = f->next_;
+        b = reinterpret_cast<mblock*>(f) - 1;
+    } else {
+        if (malloc_chunk_end - malloc_chunk < sizeof(mblock) + csize) {
+            // the rest of the old chunk is abandoned
+            void* chunk = malloc_map(MALLOC_CHUNKSIZE);
+            if (!chunk) {
+                malloc_release();
+                return nullptr;
+            }
+            malloc_chunk = reinterpret_cast<uintptr_t>(chunk);
+            malloc_chunk_end = malloc_chunk + MALLOC_CHUNKSIZE;
+        }
+        b = reinterpret_cast<mblock*>(malloc_chunk);
+        b->size_ = csize;
+        malloc_chunk += sizeof(mblock) + csize;
+    }
+    malloc_release();
+    b->used_ = size;
+    return reinterpret_cast<char*>(b + 1);
+}
+
+void free(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    mblock* b = reinterpret_cast<mblock*>(ptr) - 1;
+    if (b->size_ > MALLOC_MAXSMALL) {
+        sys_munmap(b, b->size_ + sizeof(mblock));
+        return;
+    }
+    int c = 0;
+    while ((size_t(MALLOC_ALIGN) << c) < b->size_) {
+        ++c;
+    }
+    mfree* f = reinterpret_cast<mfree*>(ptr);
+    malloc_acquire();
+    f->next_ = malloc_free[c];
+    malloc_free[c] = f;
+    malloc_release();
+}
+
+char* realloc(void* ptr, size_t size, size_t) {
+    if (!ptr) {
+        return malloc(size);
+    } else if (size == 0) {
+        free(ptr);
+        return nullptr;
+    }
+    mblock* b = reinterpret_cast<mblock*>(ptr) - 1;
+    if (size <= b->size_) {
+        b->used_ = size;
+        return reinterpret_cast<char*>(ptr);
+    }
+    // a growing large block gets slack so later growth fits in place;
+    // untouched pages cost nothing
+    char* nptr;
+    if (size > MALLOC_MAXSMALL && size <= SIZE_MAX / 2) {
+        nptr = malloc_large(size + size / 2);
+    } else {
+        nptr = malloc(size);
+    }
+    if (nptr) {
+        memcpy(nptr, ptr, b->used_);
+        reinterpret_cast<mblock*>(nptr)[-1].used_ = size;
+        free(ptr);
+    }
+    return nptr;
+}
@@ -66,6 +66,20 @@ inline uintptr_t syscall0(int syscallno, uintptr_t arg0,
     return rax;
 }
 
+inline uintptr_t syscall0(int syscallno, uintptr_t arg0,
+                          uintptr_t arg1, uintptr_t arg2,
+                          uintptr_t arg3, uintptr_t arg4) {
+    register uintptr_t rax asm("rax") = syscallno;
+    register uintptr_t r10 asm("r10") = arg3;
+    register uintptr_t r8 asm("r8") = arg4;
+    asm volatile ("syscall"
+                  : "+a" (rax), "+D" (arg0), "+S" (arg1), "+d" (arg2),
+                    "+r" (r10), "+r" (r8)
+                  :
+                  : "cc", "rcx", "r9", "r11");
+    return rax;
+}
+
 inline void clobber_memory(void* ptr) {
     asm volatile ("" : "+m" (*(char (*)[]) ptr));
 }
@@ -91,7 +105,9 @@ static inline void sys_yield(void) {
 // sys_page_alloc(addr)
 //    Allocate a page of memory at address `addr`. `Addr` must be page-aligned
 //    (i.e., a multiple of PAGESIZE == 4096). Returns 0 on success and -1
-//    on failure.
+//    on failure, e.g. if `addr` lies in the heap, the stack, or another
+//    region the kernel has promised. The page is backed on first touch,
+//    so running out of memory then kills the process.
 static inline int sys_page_alloc(void* addr) {
     return syscall0(SYSCALL_PAGE_ALLOC, reinterpret_cast<uintptr_t>(addr));
 }
@@ -245,6 +261,28 @@ inline int sys_execv(const char* program_name, const char* const* argv) {
     return sys_execv(program_name, argv, argc);
 }
 
+// sys_spawn(program_name, argv, actions, nactions)
+//    Start `program_name` with arguments `argv` (a null-terminated array)
+//    in a new child process, like `sys_fork` followed by `sys_execv` in
+//    the child, but without copying this process's memory. The child's
+//    file descriptors are copies of this process's, changed by the
+//    `nactions` file actions in `actions`. Returns the child's process
+//    ID or an error code.
+inline pid_t sys_spawn(const char* program_name, const char* const* argv,
+                       const spawn_fdaction* actions = nullptr,
+                       size_t nactions = 0) {
+    size_t argc = 0;
+    while (argv && argv[argc] != nullptr) {
+        ++argc;
+    }
+    access_memory(program_name);
+    access_memory(argv);
+    return syscall0(SYSCALL_SPAWN,
+                    reinterpret_cast<uintptr_t>(program_name),
+                    reinterpret_cast<uintptr_t>(argv), argc,
+                    reinterpret_cast<uintptr_t>(actions), nactions);
+}
+
 // sys_unlink(pathname)
 //    Remove the file named `pathname`.
 inline int sys_unlink(const char* pathname) {
@@ -330,6 +368,68 @@ inline void __attribute__((noreturn)) sys_texit(int status) {
     assert(false);
 }
 
+// sys_kalloc_dump()
+//    Log the kernel's live allocations by call site and by process.
+//    Returns E_NOSYS unless the kernel was built with `KALLOC_TRACK=1`.
+inline int sys_kalloc_dump() {
+    return syscall0(SYSCALL_KALLOC_DUMP);
+}
+
+// sys_mmap(fd, off, len, prot, flags)
+//    Map `len` bytes of the disk file open as `fd`, starting at page-aligned
+//    offset `off`, into memory. `prot` is `PROT_READ`, optionally with
+//    `PROT_WRITE`; `flags` is `MAP_SHARED` or `MAP_PRIVATE`. Pages are
+//    read when first touched. With `MAP_ANONYMOUS` in `flags`, `fd` and
+//    `off` are ignored and the memory starts zeroed; `MAP_SHARED` memory
+//    stays shared with children after `sys_fork`. Returns the address of
+//    the mapping, or an error code (test with `is_error`).
+inline void* sys_mmap(int fd, size_t off, size_t len, int prot, int flags) {
+    return reinterpret_cast<void*>(
+        syscall0(SYSCALL_MMAP, fd, off, len, prot, flags)
+    );
+}
+
+// sys_munmap(addr, len)
+//    Remove the mapping of `len` bytes at `addr` made by `sys_mmap`.
+//    Writes to a `MAP_SHARED` mapping reach the file by this point.
+inline int sys_munmap(void* addr, size_t len) {
+    return syscall0(SYSCALL_MUNMAP, reinterpret_cast<uintptr_t>(addr), len);
+}
+
+// sys_brk(addr)
+//    Move the end of the heap, which starts right after the program's data,
+//    to `addr`, and return the new end. `sys_brk(nullptr)` returns the
+//    current end. Memory past a lowered end is freed. Returns an error
+//    code if the heap can't grow that far.
+inline void* sys_brk(void* addr) {
+    return reinterpret_cast<void*>(
+        syscall0(SYSCALL_BRK, reinterpret_cast<uintptr_t>(addr))
+    );
+}
+
+// sys_shmget(key, size)
+//    Return the ID of the shared memory segment named `key`, creating it
+//    with at least `size` zeroed bytes if it doesn't exist. Key 0 always
+//    creates a new segment, which can be shared with children by ID.
+//    A segment lasts until its last attachment is removed.
+inline int sys_shmget(int key, size_t size) {
+    return syscall0(SYSCALL_SHMGET, key, size);
+}
+
+// sys_shmat(id)
+//    Attach shared memory segment `id` to this process. Returns its
+//    address, or an error code (test with `is_error`). Forked children
+//    inherit attachments.
+inline void* sys_shmat(int id) {
+    return reinterpret_cast<void*>(syscall0(SYSCALL_SHMAT, id));
+}
+
+// sys_shmdt(addr)
+//    Detach the shared memory segment attached at `addr`.
+inline int sys_shmdt(void* addr) {
+    return syscall0(SYSCALL_SHMDT, reinterpret_cast<uintptr_t>(addr));
+}
+
 // sys_panic(msg)
 //    Panic.
 static inline pid_t __attribute__((noreturn)) sys_panic(const char* msg) {
@@ -401,21 +501,19 @@ static inline void exit(int status) {
     sys_exit(status);
 }
 
-static inline char* malloc(int size) {
-    return (char*) sys_malloc(size);
-}
+// malloc(size)
+//    Allocate `size` bytes (p-lib.cc). Returns `nullptr` if `size` is 0 or
+//    memory runs out.
+char* malloc(size_t size);
 
-static inline void free(void* ptr) {
-    sys_free(ptr);
-}
+// free(ptr)
+//    Free a block from `malloc` or `realloc`. `free(nullptr)` does nothing.
+void free(void* ptr);
 
-static inline char* realloc(char* ptr, size_t size, size_t oldsize) {
-    auto newptr = malloc(size);
-    assert(newptr);
-    memcpy(newptr, ptr, oldsize);
-    // TODO: free ptr
-    return newptr;
-}
+// realloc(ptr, size, oldsize)
+//    Resize the block `ptr` to `size` bytes, in place if it has room,
+//    and return it. `oldsize` is ignored; blocks know their sizes.
+char* realloc(void* ptr, size_t size, size_t oldsize = 0);
 
 static inline int usleep(unsigned usec) {
     return sys_msleep(usec / 1000);
@@ -575,16 +673,9 @@ static inline int abs(int i) {
     return i < 0 ? -i : i;
 }
 
-#define alloca(size) ({ \
-    uintptr_t r = read_rsp(); \
-    if (size) { \
-        r = alloca_(size); \
-    } \
-    r;})
-
-static inline char* alloca_(size_t size) {
-    return malloc(size);
-}
+// alloca(size)
+//    Allocate `size` bytes in the caller's stack frame.
+#define alloca(size) __builtin_alloca(size)
 
 // implementation from GNU C Library
 //    https://code.woboq.org/userspace/glibc/string/strcasecmp.c.html
@@ -90,13 +90,15 @@ void process_main() {
                 if (skip_status < 0) {
                     pid_t child = create_child(words, nextch,
                                                redir, &pipein);
-                    if (nextch != '|'
-                        && nextch != '&'
-                        && child > 0) {
-                        int r, status = -1;
-                        while ((r = sys_waitpid(child, &status)) == E_AGAIN) {
+                    if (nextch != '|' && nextch != '&') {
+                        // a command that couldn't start has failed
+                        int r, status = 1;
+                        if (child > 0) {
+                            while ((r = sys_waitpid(child, &status))
+                                   == E_AGAIN) {
+                            }
+                            assert(r == child);
                         }
-                        assert(r == child);
                         if ((status == 0 && nextch == OROR)
                             || (status != 0 && nextch == ANDAND)) {
                             skip_status = status != 0;
@@ -120,52 +122,55 @@ void process_main() {
     sys_exit(0);
 }
 
-static void child_redirect(int fd, char* pathname) {
-    int flags;
-    if (fd == 0) {
-        flags = OF_READ;
-    } else {
-        flags = OF_WRITE | OF_CREATE | OF_TRUNC;
-    }
-    int r = sys_open(pathname, flags);
-    if (r < 0) {
-        dprintf(2, "%s: error %d\n", pathname, r);
-        sys_exit(1);
-    }
-    if (r != fd) {
-        sys_dup2(r, fd);
-        sys_close(r);
-    }
-}
-
 static pid_t create_child(char** words, char nextch,
                           char** redir, int* pipein) {
+    // the child's file descriptors are set up by `sys_spawn` file
+    // actions, so this process's memory is never copied
+    spawn_fdaction actions[11];
+    int nactions = 0;
+    int opened[3] = {-1, -1, -1};
+    pid_t child = E_BADF;
+
     int pfd[2] = {0, 0};
     if (nextch == '|') {
         int r = sys_pipe(pfd);
         assert_gt(r, -1);
     }
 
-    pid_t child = sys_fork();
-    if (child == 0) {
-        if (*pipein != 0) {
-            sys_dup2(*pipein, 0);
-            sys_close(*pipein);
-        }
-        for (int fd = 0; fd != 3; ++fd) {
-            if (redir[fd] != nullptr) {
-                child_redirect(fd, redir[fd]);
+    if (*pipein != 0) {
+        actions[nactions++] = {SPAWN_DUP2, *pipein, 0};
+        actions[nactions++] = {SPAWN_CLOSE, *pipein, 0};
+    }
+    for (int fd = 0; fd != 3; ++fd) {
+        if (redir[fd] != nullptr) {
+            int flags = fd == 0 ? OF_READ : OF_WRITE | OF_CREATE | OF_TRUNC;
+            opened[fd] = sys_open(redir[fd], flags);
+            if (opened[fd] < 0) {
+                dprintf(2, "%s: error %d\n", redir[fd], opened[fd]);
+                goto done;
+            }
+            // closing a descriptor that is already in place would lose it
+            if (opened[fd] != fd) {
+                actions[nactions++] = {SPAWN_DUP2, opened[fd], fd};
+                actions[nactions++] = {SPAWN_CLOSE, opened[fd], 0};
             }
         }
-        if (nextch == '|') {
-            sys_close(pfd[0]);
-            sys_dup2(pfd[1], 1);
-            sys_close(pfd[1]);
+    }
+    if (nextch == '|') {
+        actions[nactions++] = {SPAWN_CLOSE, pfd[0], 0};
+        if (pfd[1] != 1) {
+            actions[nactions++] = {SPAWN_DUP2, pfd[1], 1};
+            actions[nactions++] = {SPAWN_CLOSE, pfd[1], 0};
         }
-        int r = sys_execv(words[0], words);
-        sys_exit(1);
     }
+    child = sys_spawn(words[0], words, actions, nactions);
 
+ done:
+    for (int fd = 0; fd != 3; ++fd) {
+        if (opened[fd] >= 0) {
+            sys_close(opened[fd]);
+        }
+    }
     if (*pipein != 0) {
         sys_close(*pipein);
         *pipein = 0;
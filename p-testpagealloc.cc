@@ -0,0 +1,38 @@
+#include "p-lib.hh"
+
+// Allocate every page from the end of the program data up to the stack.
+// Pages below the stack's reserved range (at most 8MiB plus a 16-page
+// guard gap under the stack top) must be handed out and be writable;
+// pages inside it must be refused with an error, not kill the process.
+
+extern uint8_t end[];
+
+void process_main() {
+    sys_kdisplay(KDISPLAY_NONE);
+
+    uint8_t* heap_top = ROUNDUP((uint8_t*) end, PAGESIZE);
+    uint8_t* stack_top = ROUNDUP((uint8_t*) read_rsp(), PAGESIZE);
+    uint8_t* stack_bottom = ROUNDDOWN((uint8_t*) read_rsp() - 1, PAGESIZE);
+
+    uint8_t* a = heap_top;
+    while (a < stack_bottom && sys_page_alloc(a) == 0) {
+        *a = 1;
+        a += PAGESIZE;
+    }
+    uint8_t* reserved = a;
+    assert_lt(reserved, stack_bottom);
+    assert_le(size_t(stack_top - reserved), (8UL << 20) + 16 * PAGESIZE);
+
+    for (; a < stack_bottom; a += PAGESIZE) {
+        assert_lt(sys_page_alloc(a), 0);
+    }
+
+    for (a = heap_top; a < reserved; a += PAGESIZE) {
+        assert_eq(*a, 1);
+    }
+
+    console_printf("testpagealloc: allocated %zu pages below the stack\n",
+                   size_t(reserved - heap_top) / PAGESIZE);
+    console_printf("testpagealloc succeeded.\n");
+    sys_exit(0);
+}
@@ -17,12 +17,9 @@ void process_main() {
 
     for (size_t i = 0; strcmp(tests[i], "end") != 0; i++) {
         const char* args[] = { tests[i], nullptr };
-        int r = sys_fork();
-        if (r == 0) {
-            console_printf("\nRunning %s.\n", tests[i]);
-            sys_execv(tests[i], args);
-        }
-        else {
+        console_printf("\nRunning %s.\n", tests[i]);
+        int r = sys_spawn(tests[i], args);
+        if (r > 0) {
             sys_waitpid(r);
         }
     }
@@ -16,6 +16,7 @@
 #define PAGEINDEXBITS   9                      // # bits in a page index level
 #define PAGESIZE        (1UL << PAGEOFFBITS)   // Size of page in bytes
 #define PAGEOFFMASK     (PAGESIZE - 1)
+#define HUGEPAGESIZE    (PAGESIZE << PAGEINDEXBITS) // Size of 2MiB PS page
 
 // Permission flags: define whether page is accessible
 #define PTE_P           0x1UL    // entry is Present
@@ -209,6 +210,10 @@ DECLARE_X86_FUNCTION(void     wrmsr(uint32_t msr, uint64_t v));
 // %cr4 flag bits
 #define CR4_PSE                 0x00000010      // Page Size Extensions
 #define CR4_PAE                 0x00000020      // Physical Address Extensions
+#define CR4_PCIDE               0x00020000      // Process-Context IDs Enable
+
+// %cr3 bits used when CR4_PCIDE is set
+#define CR3_NOFLUSH             0x8000000000000000UL  // keep PCID's entries
 
 // eflags bits (useful for read_eflags() and write_eflags())
 #define EFLAGS_CF               0x00000001      // Carry Flag
@@ -361,7 +366,7 @@ static inline void lcr4(uint64_t val) {
 
 static inline uint64_t rcr4() {
     uint64_t cr4;
-    asm volatile("movl %%cr4,%0" : "=r" (cr4));
+    asm volatile("movq %%cr4,%0" : "=r" (cr4));
     return cr4;
 }
 
@@ -502,6 +507,7 @@ typedef struct x86_64_gatedescriptor {
 #define MSR_IA32_MTRR_FIX16K_A0000   0x259
 #define MSR_IA32_MTRR_FIX4K_C0000    0x268
 #define MSR_IA32_MTRR_DEF_TYPE       0x2FF
+#define MSR_IA32_PAT                 0x277
 #define MSR_IA32_EFER                0xC0000080U
 #define MSR_IA32_FS_BASE             0xC0000100U
 #define MSR_IA32_GS_BASE             0xC0000101U
@@ -510,6 +516,13 @@ typedef struct x86_64_gatedescriptor {
 #define MSR_IA32_LSTAR               0xC0000082U
 #define MSR_IA32_FMASK               0xC0000084U
 
+// page attribute table memory types (one byte per PAT entry)
+#define IA32_PAT_UC                  0x00            // uncacheable
+#define IA32_PAT_WC                  0x01            // write-combining
+#define IA32_PAT_WT                  0x04            // write-through
+#define IA32_PAT_WB                  0x06            // write-back
+#define IA32_PAT_UCMINUS             0x07            // UC, unless MTRRs say WC
+
 #define IA32_EFER_SCE                0x1             // enable syscall/sysret
 #define IA32_EFER_LME                0x100           // enable 64-bit mode
 #define IA32_EFER_NXE                0x800           // enable PTE_XD